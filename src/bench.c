@@ -0,0 +1,279 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "mymem.h"
+#include "bench.h"
+
+/* Microbenchmarks: every strategy, at several fill levels of the pool, on
+   each operation on its own. A run takes SAMPLES samples of OPS operations
+   each, every operation timed on its own with CLOCK_MONOTONIC, less what
+   reading the clock takes; whatever a sample needs set up or cleaned up
+   happens outside the clock. After one warm-up run, RUNS runs are timed,
+   and the median and 99th percentile over all their operations are
+   reported, so the p99 shows the slow operations themselves. */
+
+#define POOL_SIZE (1 << 20)
+#define OPS 64
+#define SAMPLES 16
+#define RUNS 10
+#define MIN_BLOCK 16
+#define MAX_BLOCK 512
+
+static const double fills[] = { 0, 0.5, 0.9 };
+
+/* the blocks keeping the pool at its fill level */
+static void **live;
+static int live_count, live_capacity;
+static unsigned seed;
+static volatile long sink; /* keeps the results of the queries alive */
+static double overhead; /* ns two clock readings in a row are apart */
+
+static double now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/* ns since start, the clock's own share left out */
+static double lap(double start)
+{
+	double ns = now_ns() - start - overhead;
+
+	return ns > 0 ? ns : 0;
+}
+
+static size_t random_size(void)
+{
+	return MIN_BLOCK + rand_r(&seed) % (MAX_BLOCK - MIN_BLOCK + 1);
+}
+
+static void keep(void *block)
+{
+	if (live_count == live_capacity)
+	{
+		live_capacity = live_capacity ? 2 * live_capacity : 1024;
+		live = realloc(live, live_capacity * sizeof(void*));
+	}
+	live[live_count++] = block;
+}
+
+static void allocate_to(double level)
+{
+	void *block;
+
+	while (mem_allocated() < level * mem_total() && (block = mymalloc(random_size())) != NULL)
+		keep(block);
+}
+
+/* Set the pool up fresh, filled to level with random blocks, and with holes
+   between them as a pool that has been in use for a while has */
+static void fill(strategies strategy, double level)
+{
+	int i, kept = 0;
+
+	initmem(strategy, POOL_SIZE);
+	live_count = 0;
+	seed = 1;
+	allocate_to(level);
+	for (i = 0; i < live_count; i++)
+		if (i % 3 == 0)
+			myfree(live[i]);
+		else
+			live[kept++] = live[i];
+	live_count = kept;
+	allocate_to(level);
+}
+
+static void bench_alloc(double *samples)
+{
+	void *blocks[OPS];
+	size_t sizes[OPS];
+	int s, i;
+
+	for (s = 0; s < SAMPLES; s++)
+	{
+		for (i = 0; i < OPS; i++)
+			sizes[i] = random_size();
+		for (i = 0; i < OPS; i++)
+		{
+			double start = now_ns();
+
+			blocks[i] = mymalloc(sizes[i]);
+			samples[s * OPS + i] = lap(start);
+		}
+		for (i = 0; i < OPS; i++)
+			if (blocks[i])
+				myfree(blocks[i]);
+	}
+}
+
+static void bench_free(double *samples)
+{
+	void *blocks[OPS];
+	int s, i;
+
+	for (s = 0; s < SAMPLES; s++)
+	{
+		for (i = 0; i < OPS; i++)
+			blocks[i] = mymalloc(random_size());
+		/* not in the order they came, so no free just undoes the last allocation */
+		for (i = 0; i < OPS; i++)
+		{
+			void *block = blocks[(i * 37) % OPS];
+			double start = now_ns();
+
+			if (block)
+				myfree(block);
+			samples[s * OPS + i] = lap(start);
+		}
+	}
+}
+
+static void bench_pingpong(double *samples)
+{
+	int s, i;
+
+	for (s = 0; s < SAMPLES; s++)
+	{
+		size_t size = random_size();
+
+		/* one operation is an allocation and its free */
+		for (i = 0; i < OPS; i++)
+		{
+			double start = now_ns();
+			void *block = mymalloc(size);
+
+			if (block)
+				myfree(block);
+			samples[s * OPS + i] = lap(start);
+		}
+	}
+}
+
+/* allocations larger than any of the blocks the pool was filled with, which
+   the holes between them mostly cannot take */
+static void bench_search(double *samples)
+{
+	void *blocks[OPS];
+	int s, i;
+
+	for (s = 0; s < SAMPLES; s++)
+	{
+		for (i = 0; i < OPS; i++)
+		{
+			double start = now_ns();
+
+			blocks[i] = mymalloc(2 * MAX_BLOCK);
+			samples[s * OPS + i] = lap(start);
+		}
+		for (i = 0; i < OPS; i++)
+			if (blocks[i])
+				myfree(blocks[i]);
+	}
+}
+
+static void query_holes(void) { sink += mem_holes(); }
+static void query_allocated(void) { sink += mem_allocated(); }
+static void query_free(void) { sink += mem_free(); }
+static void query_total(void) { sink += mem_total(); }
+static void query_largest_free(void) { sink += mem_largest_free(); }
+static void query_small_free(void) { sink += mem_small_free(MAX_BLOCK / 2); }
+static void query_histogram(void) { int counts[64]; sink += mem_free_histogram(counts, 64); }
+static void query_is_alloc(void) { sink += mem_is_alloc(live_count ? live[live_count / 2] : mem_pool()); }
+static void query_block_of(void) { sink += mem_block_of(live_count ? live[live_count / 2] : mem_pool(), NULL, NULL); }
+static void query_check(void) { sink += mem_check(); }
+
+static void (*query)(void);
+
+static void bench_query(double *samples)
+{
+	int s, i;
+
+	for (s = 0; s < SAMPLES; s++)
+		for (i = 0; i < OPS; i++)
+		{
+			double start = now_ns();
+
+			query();
+			samples[s * OPS + i] = lap(start);
+		}
+}
+
+static struct
+{
+	char *name;
+	void (*run)(double *samples);
+	void (*query)(void);
+} benches[] = {
+	{ "alloc", bench_alloc },
+	{ "free", bench_free },
+	{ "pingpong", bench_pingpong },
+	{ "search", bench_search },
+	{ "mem_holes", bench_query, query_holes },
+	{ "mem_allocated", bench_query, query_allocated },
+	{ "mem_free", bench_query, query_free },
+	{ "mem_total", bench_query, query_total },
+	{ "mem_largest_free", bench_query, query_largest_free },
+	{ "mem_small_free", bench_query, query_small_free },
+	{ "mem_free_histogram", bench_query, query_histogram },
+	{ "mem_is_alloc", bench_query, query_is_alloc },
+	{ "mem_block_of", bench_query, query_block_of },
+	{ "mem_check", bench_query, query_check },
+};
+
+static int by_value(const void *x, const void *y)
+{
+	double a = *(const double*)x, b = *(const double*)y;
+
+	return (a > b) - (a < b);
+}
+
+/* "mem -bench [strategy|all] [benchmark]" runs every benchmark whose name
+   contains the given one, on the given strategy or all of them */
+int run_benchmarks(int argc, char **argv)
+{
+	strategies strategy;
+	int lbound = 1;
+	int ubound = LastStrategy;
+	const char *only = argc > 2 ? argv[2] : "";
+	static double samples[RUNS * SAMPLES * OPS];
+	int b, f, r;
+
+	if (argc > 1 && strategyFromString(argv[1]) > 0)
+		lbound = ubound = strategyFromString(argv[1]);
+
+	/* the median of many empty laps is what the clock takes */
+	overhead = 0;
+	for (r = 0; r < SAMPLES * OPS; r++)
+		samples[r] = lap(now_ns());
+	qsort(samples, SAMPLES * OPS, sizeof(double), by_value);
+	overhead = samples[SAMPLES * OPS / 2];
+
+	printf("%-8s %-20s %6s %12s %12s\n", "", "", "fill", "median ns", "p99 ns");
+	for (strategy = lbound; strategy <= ubound; strategy++)
+		for (b = 0; b < sizeof(benches) / sizeof(benches[0]); b++)
+		{
+			if (!strstr(benches[b].name, only))
+				continue;
+			query = benches[b].query;
+			for (f = 0; f < sizeof(fills) / sizeof(fills[0]); f++)
+			{
+				fill(strategy, fills[f]);
+				benches[b].run(samples); /* warm-up */
+				for (r = 0; r < RUNS; r++)
+					benches[b].run(samples + r * SAMPLES * OPS);
+
+				qsort(samples, RUNS * SAMPLES * OPS, sizeof(double), by_value);
+				printf("%-8s %-20s %5.0f%% %12.1f %12.1f\n", strategy_name(strategy), benches[b].name,
+					100 * fills[f], samples[RUNS * SAMPLES * OPS / 2], samples[RUNS * SAMPLES * OPS * 99 / 100]);
+			}
+		}
+	free(live);
+	live = NULL;
+	live_capacity = 0;
+	return 0;
+}
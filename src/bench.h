@@ -0,0 +1,7 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/* Microbenchmarks of the allocator, run with "mem -bench". */
+int run_benchmarks(int argc, char **argv);
+
+#endif
@@ -0,0 +1,637 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include "bitmap.h"
+
+/* Bitmap allocator, see bitmap.h.
+ *
+ * Granule g is bit g % 64 of word g / 64, so lower addresses are in the low
+ * bits and runs of free granules are found with ctz/clz on whole words. With
+ * AVX2 available, the search skips four fully allocated words at a time.
+ */
+
+#define NONE ((size_t)-1)
+
+// word kinds the scans below can look for set bits in
+enum bitKind
+{
+    USED,    // allocated granules
+    FREE,    // free granules
+    STARTS,  // first granules of allocated blocks
+    BOUNDARY // granules that end an allocated block: free ones and the starts of the next block
+};
+
+static unsigned long long wordOf(struct bitmap_pool *b, size_t w, enum bitKind kind)
+{
+    switch (kind)
+    {
+    case USED:
+        return b->used[w];
+    case FREE:
+        return ~b->used[w];
+    case STARTS:
+        return b->starts[w];
+    default:
+        return ~b->used[w] | b->starts[w];
+    }
+}
+
+/* Index of the first bit of the given kind at or after from, words * 64 if there is none. */
+static size_t nextBit(struct bitmap_pool *b, size_t from, enum bitKind kind)
+{
+    size_t w = from / 64;
+    unsigned long long word;
+
+    if (w >= b->words)
+    {
+        return b->words * 64;
+    }
+
+    // ignore the bits below from in the first word
+    word = wordOf(b, w, kind) & (~0ULL << (from % 64));
+    while (!word)
+    {
+        if (++w == b->words)
+        {
+            return b->words * 64;
+        }
+        word = wordOf(b, w, kind);
+    }
+    return w * 64 + __builtin_ctzll(word);
+}
+
+/* Index of the last bit of the given kind before before, NONE if there is none. */
+static size_t prevBit(struct bitmap_pool *b, size_t before, enum bitKind kind)
+{
+    size_t w;
+    unsigned long long word;
+
+    if (before == 0)
+    {
+        return NONE;
+    }
+    w = (before - 1) / 64;
+
+    // ignore the bits from before on in the first word
+    word = wordOf(b, w, kind) & (~0ULL >> (63 - (before - 1) % 64));
+    while (!word)
+    {
+        if (w-- == 0)
+        {
+            return NONE;
+        }
+        word = wordOf(b, w, kind);
+    }
+    return w * 64 + 63 - __builtin_clzll(word);
+}
+
+static int isFree(struct bitmap_pool *b, size_t g)
+{
+    return g < b->granules && !((b->used[g / 64] >> (g % 64)) & 1);
+}
+
+/* Set (value 1) or clear (value 0) bits from up to, but not including, to. */
+static void setRange(unsigned long long *bits, size_t from, size_t to, int value)
+{
+    while (from < to)
+    {
+        size_t w = from / 64, shift = from % 64;
+        size_t count = to - from < 64 - shift ? to - from : 64 - shift;
+        unsigned long long mask = (count == 64 ? ~0ULL : ((1ULL << count) - 1)) << shift;
+
+        if (value)
+        {
+            bits[w] |= mask;
+        }
+        else
+        {
+            bits[w] &= ~mask;
+        }
+        from += count;
+    }
+}
+
+/* Bit i of the result is set if granules i to i+n-1 of the word are all free, n <= 64. */
+static unsigned long long runStarts(unsigned long long free, size_t n)
+{
+    size_t have = 1;
+
+    // each step doubles (at most) the run length every remaining bit vouches for
+    while (have < n)
+    {
+        size_t shift = have < n - have ? have : n - have;
+        free &= free >> shift;
+        have += shift;
+    }
+    return free;
+}
+
+/* First granule of the lowest run of n free granules, NONE if there is none. */
+static size_t findRun(struct bitmap_pool *b, size_t n)
+{
+    size_t w, run = 0, runStart = 0;
+
+    for (w = b->hint; w < b->words; w++)
+    {
+        unsigned long long used = b->used[w];
+
+#ifdef __AVX2__
+        // nothing to carry over and four full words ahead: skip them in one go
+        if (run == 0 && w + 4 <= b->words)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)&b->used[w]);
+            if (_mm256_testc_si256(v, _mm256_set1_epi64x(-1)))
+            {
+                w += 3;
+                continue;
+            }
+        }
+#endif
+
+        if (used == 0)
+        {
+            if (run == 0)
+            {
+                runStart = w * 64;
+            }
+            run += 64;
+            if (run >= n)
+            {
+                return runStart;
+            }
+            continue;
+        }
+        if (used == ~0ULL)
+        {
+            run = 0;
+            continue;
+        }
+
+        // free granules at the bottom of the word continue the run from the words before
+        if (run && run + __builtin_ctzll(used) >= n)
+        {
+            return runStart;
+        }
+        if (n <= 64)
+        {
+            unsigned long long fits = runStarts(~used, n);
+            if (fits)
+            {
+                return w * 64 + __builtin_ctzll(fits);
+            }
+        }
+
+        // free granules at the top of the word start a new run
+        run = __builtin_clzll(used);
+        runStart = w * 64 + 64 - run;
+    }
+
+    return NONE;
+}
+
+void bitmap_init(struct bitmap_pool *b, void *base, size_t size, size_t granule)
+{
+    b->base = base;
+    b->granule = granule ? granule : 1;
+    b->granules = size / b->granule;
+    b->words = (b->granules + 63) / 64;
+    b->used = calloc(b->words, sizeof(unsigned long long));
+    b->starts = calloc(b->words, sizeof(unsigned long long));
+
+    // padding past the last granule is permanently allocated so runs never reach into it
+    setRange(b->used, b->granules, b->words * 64, 1);
+
+    b->freeGranules = b->granules;
+    b->holes = b->granules > 0;
+    b->largest = b->granules;
+    b->largestStale = 0;
+    b->hint = 0;
+}
+
+void bitmap_destroy(struct bitmap_pool *b)
+{
+    free(b->used);
+    free(b->starts);
+    b->used = b->starts = NULL;
+}
+
+/* Allocate the n free granules from start on as one block. */
+static void *claimRun(struct bitmap_pool *b, size_t start, size_t n)
+{
+    size_t end = start + n;
+    size_t runStart;
+    int left, right;
+
+    // the run shrinks or splits, it can only have been the longest if it was that long;
+    // an aligned claim may start anywhere in it
+    if (!b->largestStale)
+    {
+        runStart = prevBit(b, start, USED);
+        runStart = runStart == NONE ? 0 : runStart + 1;
+        if (nextBit(b, start, USED) - runStart == b->largest)
+        {
+            b->largestStale = 1;
+        }
+    }
+
+    left = start > 0 && isFree(b, start - 1);
+    right = isFree(b, end);
+    b->holes += (left && right) ? 1 : (!left && !right) ? -1 : 0;
+
+    setRange(b->used, start, end, 1);
+    b->starts[start / 64] |= 1ULL << (start % 64);
+    b->freeGranules -= n;
+
+    while (b->hint < b->words && b->used[b->hint] == ~0ULL)
+    {
+        b->hint++;
+    }
+
+    return b->base + start * b->granule;
+}
+
+void *bitmap_alloc(struct bitmap_pool *b, size_t requested)
+{
+    size_t n = (requested + b->granule - 1) / b->granule;
+    size_t start;
+
+    if (n == 0 || n > b->freeGranules)
+    {
+        return NULL;
+    }
+
+    start = findRun(b, n);
+    if (start == NONE)
+    {
+        return NULL;
+    }
+    return claimRun(b, start, n);
+}
+
+/* Like bitmap_alloc, but for a block starting at an address that is a
+ * multiple of alignment. The granules skipped in front of it stay free.
+ */
+void *bitmap_alloc_aligned(struct bitmap_pool *b, size_t requested, size_t alignment)
+{
+    size_t n = (requested + b->granule - 1) / b->granule;
+    size_t start, end;
+
+    if (n == 0 || n > b->freeGranules)
+    {
+        return NULL;
+    }
+
+    for (start = nextBit(b, b->hint * 64, FREE); start < b->granules; start = nextBit(b, end, FREE))
+    {
+        size_t g = start;
+
+        end = nextBit(b, start, USED);
+        // granules need not divide the alignment, so step to the first aligned one
+        while (g < end && (size_t)(b->base + g * b->granule) % alignment)
+        {
+            g++;
+        }
+        if (g < end && end - g >= n)
+        {
+            return claimRun(b, g, n);
+        }
+    }
+    return NULL;
+}
+
+void bitmap_free(struct bitmap_pool *b, void *ptr)
+{
+    size_t start, end, runStart, runEnd;
+    int left, right;
+
+    if ((char *)ptr < b->base || ((char *)ptr - b->base) % b->granule)
+    {
+        return;
+    }
+    start = ((char *)ptr - b->base) / b->granule;
+    if (start >= b->granules || !((b->starts[start / 64] >> (start % 64)) & 1))
+    {
+        return;
+    }
+
+    end = nextBit(b, start + 1, BOUNDARY);
+    if (end > b->granules)
+    {
+        end = b->granules;
+    }
+
+    left = start > 0 && isFree(b, start - 1);
+    right = isFree(b, end);
+    b->holes += (left && right) ? -1 : (!left && !right) ? 1 : 0;
+
+    setRange(b->used, start, end, 0);
+    b->starts[start / 64] &= ~(1ULL << (start % 64));
+    b->freeGranules += end - start;
+
+    if (start / 64 < b->hint)
+    {
+        b->hint = start / 64;
+    }
+
+    // the merged run is the only one that grew
+    if (!b->largestStale)
+    {
+        runStart = prevBit(b, start, USED);
+        runStart = runStart == NONE ? 0 : runStart + 1;
+        runEnd = nextBit(b, end, USED);
+        if (runEnd - runStart > b->largest)
+        {
+            b->largest = runEnd - runStart;
+        }
+    }
+}
+
+/* Resize the allocated block at ptr to hold size bytes without moving it, by
+ * giving up the granules at its end or taking the free ones following it.
+ * Returns 1 if the block now has the new size, 0 if it was left alone.
+ */
+int bitmap_resize(struct bitmap_pool *b, void *ptr, size_t size)
+{
+    size_t start, end, n, runEnd;
+
+    if ((char *)ptr < b->base || ((char *)ptr - b->base) % b->granule)
+    {
+        return 0;
+    }
+    start = ((char *)ptr - b->base) / b->granule;
+    if (start >= b->granules || !((b->starts[start / 64] >> (start % 64)) & 1))
+    {
+        return 0;
+    }
+    end = nextBit(b, start + 1, BOUNDARY);
+    if (end > b->granules)
+    {
+        end = b->granules;
+    }
+    n = (size + b->granule - 1) / b->granule;
+    n = n ? n : 1;
+
+    if (start + n == end)
+    {
+        return 1;
+    }
+    if (start + n < end)
+    {
+        // the freed tail is a new hole unless it joins the free run after the block
+        b->holes += !isFree(b, end);
+        setRange(b->used, start + n, end, 0);
+        b->freeGranules += end - start - n;
+        if ((start + n) / 64 < b->hint)
+        {
+            b->hint = (start + n) / 64;
+        }
+        if (!b->largestStale && nextBit(b, end, USED) - (start + n) > b->largest)
+        {
+            b->largest = nextBit(b, end, USED) - (start + n);
+        }
+        return 1;
+    }
+
+    // the padding past the last granule counts as used, so the run never reaches beyond the pool
+    runEnd = nextBit(b, end, USED);
+    if (runEnd < start + n)
+    {
+        return 0;
+    }
+
+    if (!b->largestStale && runEnd - end == b->largest)
+    {
+        b->largestStale = 1;
+    }
+    b->holes -= runEnd == start + n;
+    setRange(b->used, end, start + n, 1);
+    b->freeGranules -= start + n - end;
+    while (b->hint < b->words && b->used[b->hint] == ~0ULL)
+    {
+        b->hint++;
+    }
+    return 1;
+}
+
+size_t bitmap_free_bytes(struct bitmap_pool *b)
+{
+    return b->freeGranules * b->granule;
+}
+
+int bitmap_holes(struct bitmap_pool *b)
+{
+    return b->holes;
+}
+
+/* Call visit for every run of free granules, in address order. */
+static void forEachRun(struct bitmap_pool *b, void (*visit)(size_t start, size_t length, void *arg), void *arg)
+{
+    size_t start = nextBit(b, 0, FREE);
+
+    while (start < b->granules)
+    {
+        size_t end = nextBit(b, start, USED);
+        visit(start, end - start, arg);
+        start = nextBit(b, end, FREE);
+    }
+}
+
+static void longestRun(size_t start, size_t length, void *arg)
+{
+    size_t *longest = arg;
+
+    if (length > *longest)
+    {
+        *longest = length;
+    }
+}
+
+size_t bitmap_largest_free(struct bitmap_pool *b)
+{
+    if (b->largestStale)
+    {
+        b->largest = 0;
+        forEachRun(b, longestRun, &b->largest);
+        b->largestStale = 0;
+    }
+    return b->largest * b->granule;
+}
+
+struct smallRuns
+{
+    size_t limit; // longest run, in granules, that counts as small
+    int count;
+};
+
+static void countSmallRun(size_t start, size_t length, void *arg)
+{
+    struct smallRuns *small = arg;
+
+    small->count += length <= small->limit;
+}
+
+int bitmap_small_free(struct bitmap_pool *b, size_t size)
+{
+    struct smallRuns small = {size / b->granule, 0};
+
+    forEachRun(b, countSmallRun, &small);
+    return small.count;
+}
+
+struct runHistogram
+{
+    struct bitmap_pool *b;
+    int *counts;
+    int n;
+    int used;
+};
+
+static void countRunSize(size_t start, size_t length, void *arg)
+{
+    struct runHistogram *h = arg;
+    int k = 63 - __builtin_clzll(length * h->b->granule);
+
+    if (k < h->n)
+    {
+        h->counts[k]++;
+    }
+    if (k + 1 > h->used)
+    {
+        h->used = k + 1;
+    }
+}
+
+int bitmap_histogram(struct bitmap_pool *b, int *counts, int n)
+{
+    struct runHistogram h = {b, counts, n, 0};
+
+    memset(counts, 0, n * sizeof(int));
+    forEachRun(b, countRunSize, &h);
+    return h.used;
+}
+
+/* Find the allocated block or free run holding ptr.
+ * Returns 1 if it is allocated, 0 if it is free and -1 if ptr is outside the pool.
+ */
+int bitmap_block_of(struct bitmap_pool *b, void *ptr, void **start, size_t *size)
+{
+    size_t g, first, end;
+    int alloc;
+
+    if ((char *)ptr < b->base || (size_t)((char *)ptr - b->base) >= b->granules * b->granule)
+    {
+        return -1;
+    }
+    g = ((char *)ptr - b->base) / b->granule;
+
+    alloc = !isFree(b, g);
+    if (alloc)
+    {
+        first = prevBit(b, g + 1, STARTS);
+        end = nextBit(b, first + 1, BOUNDARY);
+    }
+    else
+    {
+        first = prevBit(b, g, USED);
+        first = first == NONE ? 0 : first + 1;
+        end = nextBit(b, g, USED);
+    }
+    if (end > b->granules)
+    {
+        end = b->granules;
+    }
+
+    if (start)
+    {
+        *start = b->base + first * b->granule;
+    }
+    if (size)
+    {
+        *size = (end - first) * b->granule;
+    }
+    return alloc;
+}
+
+void bitmap_print(struct bitmap_pool *b)
+{
+    size_t g = 0;
+
+    while (g < b->granules)
+    {
+        int alloc = !isFree(b, g);
+        size_t end = alloc ? nextBit(b, g + 1, BOUNDARY) : nextBit(b, g, USED);
+
+        if (end > b->granules)
+        {
+            end = b->granules;
+        }
+        printf("\t%p,\tsize: %zu,\t%s\n", b->base + g * b->granule, (end - g) * b->granule, (alloc ? "[allocd]" : "[free]"));
+        g = end;
+    }
+}
+
+struct runCount
+{
+    size_t granules;
+    int runs;
+    size_t longest;
+};
+
+static void countRun(size_t start, size_t length, void *arg)
+{
+    struct runCount *c = arg;
+
+    c->granules += length;
+    c->runs++;
+    if (length > c->longest)
+    {
+        c->longest = length;
+    }
+}
+
+/* Recount everything from the bit arrays and compare with the running counters.
+ * Returns 0 if everything agrees, otherwise prints what does not and returns 1.
+ */
+int bitmap_check(struct bitmap_pool *b)
+{
+    struct runCount c = {0, 0, 0};
+    int errors = 0;
+    size_t w;
+
+    forEachRun(b, countRun, &c);
+
+    for (w = 0; w < b->words; w++)
+    {
+        if (b->starts[w] & ~b->used[w])
+        {
+            printf("bitmap_check: block start on a free granule in word %zu\n", w);
+            errors++;
+        }
+        if (w < b->hint && b->used[w] != ~0ULL)
+        {
+            printf("bitmap_check: free granule below the search hint in word %zu\n", w);
+            errors++;
+        }
+    }
+    if (c.granules != b->freeGranules)
+    {
+        printf("bitmap_check: %zu granules free, counter says %zu\n", c.granules, b->freeGranules);
+        errors++;
+    }
+    if (c.runs != b->holes)
+    {
+        printf("bitmap_check: %d holes, counter says %d\n", c.runs, b->holes);
+        errors++;
+    }
+    if (!b->largestStale && c.longest != b->largest)
+    {
+        printf("bitmap_check: longest run is %zu granules, counter says %zu\n", c.longest, b->largest);
+        errors++;
+    }
+
+    return errors > 0;
+}
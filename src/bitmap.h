@@ -0,0 +1,43 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stddef.h>
+
+/* A pool managed as a bit array: one bit per granule of the pool, set while
+ * the granule is allocated, plus a second bit array marking the first
+ * granule of every allocated block so a free knows where its block ends.
+ */
+struct bitmap_pool
+{
+    char *base;      // first byte of the pool
+    size_t granule;  // bytes per bit
+    size_t granules; // usable granules, a tail smaller than one granule is left out
+    size_t words;    // 64-bit words per bit array
+
+    unsigned long long *used;   // 1 for allocated granules, and for the padding past the last one
+    unsigned long long *starts; // 1 for the first granule of each allocated block
+
+    size_t freeGranules;
+    int holes;          // number of runs of free granules
+    size_t largest;     // longest run of free granules, valid unless largestStale
+    int largestStale;   // 1 once an allocation may have shortened the longest run
+    size_t hint;        // no word below this one has a free granule
+};
+
+void bitmap_init(struct bitmap_pool *b, void *base, size_t size, size_t granule);
+void bitmap_destroy(struct bitmap_pool *b);
+void *bitmap_alloc(struct bitmap_pool *b, size_t requested);
+void *bitmap_alloc_aligned(struct bitmap_pool *b, size_t requested, size_t alignment);
+void bitmap_free(struct bitmap_pool *b, void *ptr);
+int bitmap_resize(struct bitmap_pool *b, void *ptr, size_t size);
+
+size_t bitmap_free_bytes(struct bitmap_pool *b);
+int bitmap_holes(struct bitmap_pool *b);
+size_t bitmap_largest_free(struct bitmap_pool *b);
+int bitmap_small_free(struct bitmap_pool *b, size_t size);
+int bitmap_histogram(struct bitmap_pool *b, int *counts, int n);
+int bitmap_block_of(struct bitmap_pool *b, void *ptr, void **start, size_t *size);
+void bitmap_print(struct bitmap_pool *b);
+int bitmap_check(struct bitmap_pool *b);
+
+#endif
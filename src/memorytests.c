@@ -5,26 +5,172 @@
 #include <assert.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
 
 #include "mymem.h"
 #include "testrunner.h"
+#include "trace.h"
+#include "bench.h"
 
-/* performs a randomized test:
-	totalSize == the total size of the memory pool, as passed to initmem2
-		totalSize must be less than 10,000 * minBlockSize
+/* parameters of a randomized test:
+	totalSize == the total size of the memory pool, as passed to initmem
 	fillRatio == when the allocated memory is >= fillRatio * totalSize, a block is freed;
 		otherwise, a new block is allocated.
 		If a block cannot be allocated, this is tallied and a random block is freed immediately thereafter in the next iteration
 	minBlockSize, maxBlockSize == size for allocated blocks is picked uniformly at random between these two numbers, inclusive
 	*/
-void do_randomized_test(int strategyToUse, int totalSize, float fillRatio, int minBlockSize, int maxBlockSize, int iterations)
+struct stress_config
+{
+	size_t totalSize;
+	double fillRatio;
+	size_t minBlockSize, maxBlockSize;
+	long iterations;
+};
+
+/* what the stress test runs, and mem -stress unless told otherwise */
+static const struct stress_config stress_suite[] = {
+	{10000,0.25,1,1000,10000},
+	{10000,0.25,1,2000,10000},
+	{10000,0.25,1000,2000,10000},
+	{10000,0.25,1,3000,10000},
+	{10000,0.25,1,4000,10000},
+	{10000,0.25,1,5000,10000},
+
+	{10000,0.5,1,1000,10000},
+	{10000,0.5,1,2000,10000},
+	{10000,0.5,1000,2000,10000},
+	{10000,0.5,1,3000,10000},
+	{10000,0.5,1,4000,10000},
+	{10000,0.5,1,5000,10000},
+
+	{10000,0.5,1000,1000,10000}, /* watch what happens with this test!...why? */
+
+	{10000,0.75,1,1000,10000},
+	{10000,0.75,500,1000,10000},
+	{10000,0.75,1,2000,10000},
+
+	{10000,0.9,1,500,10000},
+};
+
+struct stress_result
+{
+	double ms;      /* the whole run, sampling the pool after every iteration included */
+	double seconds; /* spent in mymalloc and myfree alone */
+	long ops;       /* calls to mymalloc and myfree */
+	long failed;
+	double avg_hole_size, avg_largest_free, avg_allocated, avg_small_blocks;
+};
+
+/* a block size in [min, max], also for ranges past RAND_MAX */
+static size_t random_size(unsigned *seed, size_t min, size_t max)
+{
+	unsigned long long r = (unsigned long long)rand_r(seed) << 31 | rand_r(seed);
+
+	return min + r % (max - min + 1);
+}
+
+/* performs a randomized test of one strategy, with the random numbers drawn from seed.
+   Live blocks are kept in an array that grows as needed, so any number of them fits. */
+static int randomized_run(strategies strategy, const struct stress_config *c, unsigned seed, struct stress_result *r)
+{
+	size_t smallBlockSize = c->maxBlockSize/10;
+	size_t storedPointers = 0, capacity = 1024;
+	void **pointers = malloc(capacity * sizeof(void*));
+	struct timespec execstart, execend, opstart, opend;
+	int force_free = 0;
+	long i;
+
+	if (pointers == NULL)
+		return 1;
+	memset(r, 0, sizeof(*r));
+	initmem(strategy,c->totalSize);
+
+	clock_gettime(CLOCK_MONOTONIC, &execstart);
+
+	for (i = 0; i < c->iterations; i++)
+	{
+		if (!force_free && (mem_free() > (c->totalSize * (1-c->fillRatio))))
+		{
+			size_t newBlockSize = random_size(&seed, c->minBlockSize, c->maxBlockSize);
+			void * pointer;
+
+			if (storedPointers == capacity)
+			{
+				void **grown = realloc(pointers, 2 * capacity * sizeof(void*));
+
+				if (grown == NULL)
+				{
+					free(pointers);
+					return 1;
+				}
+				pointers = grown;
+				capacity *= 2;
+			}
+
+			/* allocate */
+			clock_gettime(CLOCK_MONOTONIC, &opstart);
+			pointer = mymalloc(newBlockSize);
+			clock_gettime(CLOCK_MONOTONIC, &opend);
+			if (pointer != NULL)
+				pointers[storedPointers++] = pointer;
+			else
+			{ 
+				r->failed++;
+				force_free = 1;
+			}
+		}
+		else
+		{
+			size_t chosen;
+			void * pointer;
+
+			/* free */
+			force_free = 0;
+
+			if (storedPointers == 0)
+				continue;
+
+			chosen = rand_r(&seed) % storedPointers;
+			pointer = pointers[chosen];
+			pointers[chosen] = pointers[storedPointers-1];
+
+			storedPointers--;
+
+			clock_gettime(CLOCK_MONOTONIC, &opstart);
+			myfree(pointer);
+			clock_gettime(CLOCK_MONOTONIC, &opend);
+		}
+		r->seconds += (opend.tv_sec - opstart.tv_sec) + (opend.tv_nsec - opstart.tv_nsec) / 1e9;
+		r->ops++;
+
+		r->avg_largest_free += mem_largest_free();
+		if (mem_holes() > 0)
+			r->avg_hole_size += (mem_free() / mem_holes());
+		r->avg_allocated += mem_allocated();
+		r->avg_small_blocks += mem_small_free(smallBlockSize);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &execend);
+
+	r->ms = (execend.tv_sec - execstart.tv_sec) * 1000 + (execend.tv_nsec - execstart.tv_nsec) / 1000000.0;
+	if (c->iterations > 0)
+	{
+		r->avg_hole_size /= c->iterations;
+		r->avg_largest_free /= c->iterations;
+		r->avg_allocated /= c->iterations;
+		r->avg_small_blocks /= c->iterations;
+	}
+	free(pointers);
+	return 0;
+}
+
+/* performs a randomized test against one strategy, or all of them for strategyToUse 0, and logs the results */
+void do_randomized_test(int strategyToUse, const struct stress_config *c, unsigned seed)
 {
-	void * pointers[10000];
-	int storedPointers = 0;
 	int strategy;
 	int lbound = 1;
-	int ubound = 4;
-	int smallBlockSize = maxBlockSize/10;
+	int ubound = LastStrategy;
 
 	if (strategyToUse>0)
 		lbound=ubound=strategyToUse;
@@ -36,118 +182,477 @@ void do_randomized_test(int strategyToUse, int totalSize, float fillRatio, int m
 	  return;
 	}
 
-	fprintf(log,"Running randomized tests: pool size == %d, fill ratio == %f, block size is from %d to %d, %d iterations\n",totalSize,fillRatio,minBlockSize,maxBlockSize,iterations);
+	fprintf(log,"Running randomized tests: pool size == %zu, fill ratio == %f, block size is from %zu to %zu, %ld iterations, seed %u\n",c->totalSize,c->fillRatio,c->minBlockSize,c->maxBlockSize,c->iterations,seed);
 
 	fclose(log);
 
 	for (strategy = lbound; strategy <= ubound; strategy++)
 	{
-		double sum_largest_free = 0;
-		double sum_hole_size = 0;
-		double sum_allocated = 0;
-		int failed_allocations = 0;
-		double sum_small = 0;
-		struct timespec execstart, execend;
-		int force_free = 0;
-		int i;
-		storedPointers = 0;
+		struct stress_result r;
+
+		if (randomized_run(strategy, c, seed, &r) != 0)
+		{
+			perror("Can't keep track of the blocks.\n");
+			return;
+		}
+
+		log = fopen("tests.log","a");
+		if(log == NULL) {
+		  perror("Can't append to log file.\n");
+		  return;
+		}
+		
+		fprintf(log,"\t=== %s ===\n",strategy_name(strategy));
+		fprintf(log,"\tTest took %.2fms.\n", r.ms);
+		fprintf(log,"\tAverage hole size: %f\n",r.avg_hole_size);
+		fprintf(log,"\tAverage largest free block: %f\n",r.avg_largest_free);
+		fprintf(log,"\tAverage allocated bytes: %f\n",r.avg_allocated);
+		fprintf(log,"\tAverage number of small blocks: %f\n",r.avg_small_blocks);
+		fprintf(log,"\tFailed allocations: %ld\n",r.failed);
+		fclose(log);
+
 
-		initmem(strategy,totalSize);
+	}
+}
+
+struct worker
+{
+	unsigned seed;
+	int budget; /* bytes this thread may hold at once */
+	int minBlockSize, maxBlockSize, iterations;
+	long ops;
+	int failed;
+};
+
+/* one thread of do_threaded_test: random allocations and frees within its own budget,
+   everything is freed again at the end */
+static void *threaded_worker(void *arg)
+{
+	struct worker *w = arg;
+	void *pointers[1000];
+	int sizes[1000];
+	int storedPointers = 0, held = 0;
+	int i;
 
-		clock_gettime(CLOCK_REALTIME, &execstart);
+	for (i = 0; i < w->iterations; i++)
+	{
+		int newBlockSize = (rand_r(&w->seed)%(w->maxBlockSize-w->minBlockSize+1))+w->minBlockSize;
 
-		for (i = 0; i < iterations; i++)
+		if (storedPointers < 1000 && held + newBlockSize <= w->budget && rand_r(&w->seed) % 2)
 		{
-			if ( (i % 10000)==0 )
-				srand ( time(NULL) );
-			if (!force_free && (mem_free() > (totalSize * (1-fillRatio))))
+			void *pointer = mymalloc(newBlockSize);
+			if (pointer != NULL)
 			{
-				int newBlockSize = (rand()%(maxBlockSize-minBlockSize+1))+minBlockSize;
-				/* allocate */
-				void * pointer = mymalloc(newBlockSize);
-				if (pointer != NULL)
-					pointers[storedPointers++] = pointer;
-				else
-				{ 
-					failed_allocations++;
-					force_free = 1;
-				}
+				sizes[storedPointers] = newBlockSize;
+				pointers[storedPointers++] = pointer;
+				held += newBlockSize;
 			}
 			else
+				w->failed++;
+		}
+		else if (storedPointers > 0)
+		{
+			int chosen = rand_r(&w->seed) % storedPointers;
+
+			myfree(pointers[chosen]);
+			held -= sizes[chosen];
+			pointers[chosen] = pointers[storedPointers-1];
+			sizes[chosen] = sizes[storedPointers-1];
+			storedPointers--;
+		}
+		w->ops++;
+	}
+
+	while (storedPointers > 0)
+		myfree(pointers[--storedPointers]);
+	return NULL;
+}
+
+/* performs a randomized test from 1 up to maxThreads threads at once, each thread allocating and
+   freeing on its own with a 1/threads share of fillRatio * totalSize, and logs the throughput.
+   Returns 1 if the pool is not back to its initial state once all threads are done. */
+int do_threaded_test(int strategyToUse, int totalSize, float fillRatio, int minBlockSize, int maxBlockSize, int iterations, int maxThreads)
+{
+	int strategy;
+	int lbound = 1;
+	int ubound = LastStrategy;
+	mem_options opts = { .headers = 1, .thread_cache = 1 };
+
+	if (strategyToUse>0)
+		lbound=ubound=strategyToUse;
+
+	FILE *log;
+	log = fopen("tests.log","a");
+	if(log == NULL) {
+	  perror("Can't append to log file.\n");
+	  return 1;
+	}
+	fprintf(log,"Running threaded tests: pool size == %d, fill ratio == %f, block size is from %d to %d, %d iterations per thread\n",totalSize,fillRatio,minBlockSize,maxBlockSize,iterations);
+	fclose(log);
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		double baseline = 0;
+		int threads;
+
+		initmem_opts(strategy,totalSize,&opts);
+
+		for (threads = 1; threads <= maxThreads; threads *= 2)
+		{
+			pthread_t ids[64];
+			struct worker workers[64];
+			struct timespec execstart, execend;
+			size_t largest = mem_largest_free();
+			double ms, rate;
+			long ops = 0;
+			int failed = 0;
+			int i;
+
+			clock_gettime(CLOCK_MONOTONIC, &execstart);
+			for (i = 0; i < threads; i++)
+			{
+				workers[i] = (struct worker){ .seed = i + 1, .budget = totalSize * fillRatio / threads,
+					.minBlockSize = minBlockSize, .maxBlockSize = maxBlockSize, .iterations = iterations };
+				pthread_create(&ids[i], NULL, threaded_worker, &workers[i]);
+			}
+			for (i = 0; i < threads; i++)
 			{
-				int chosen;
-				void * pointer;
+				pthread_join(ids[i], NULL);
+				ops += workers[i].ops;
+				failed += workers[i].failed;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &execend);
+
+			ms = (execend.tv_sec - execstart.tv_sec) * 1000 + (execend.tv_nsec - execstart.tv_nsec) / 1000000.0;
+			rate = ops / (ms > 0 ? ms : 1e-3) * 1000;
+			if (threads == 1)
+				baseline = rate;
+
+			log = fopen("tests.log","a");
+			if(log == NULL) {
+			  perror("Can't append to log file.\n");
+			  return 1;
+			}
+			fprintf(log,"\t=== %s, %d threads ===\n",strategy_name(strategy),threads);
+			fprintf(log,"\tTest took %.2fms, %.0f ops/s, %.2fx the single thread rate.\n",ms,rate,rate/baseline);
+			fprintf(log,"\tFailed allocations: %d\n",failed);
+			fclose(log);
+
+			/* exiting threads gave their cached blocks back, all of them */
+			if (mem_check() != 0 || mem_largest_free() != largest)
+			{
+				printf("Pool not restored after %d threads with %s\n", threads, strategy_name(strategy));
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+static double elapsed_ns(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+/* Time a large pool backed in each of the ways mem_options offers: setting it up,
+   filling it with blocks, touching random blocks and refilling it after freeing every
+   other block. Run as "mem -pagebench [megabytes] [strategy]", 256 MB first fit by default. */
+int do_page_bench(int argc, char **argv)
+{
+	struct {
+		char *name;
+		mem_options opts;
+	} setups[] = {
+		{ "4k pages", { .headers = 1 } },
+		{ "4k populated", { .headers = 1, .populate = 1 } },
+		{ "2m pages", { .headers = 1, .huge_pages = 1 } },
+		{ "2m populated", { .headers = 1, .huge_pages = 1, .populate = 1 } },
+	};
+	size_t size = (argc > 1 ? atol(argv[1]) : 256) << 20;
+	strategies strategy = argc > 2 && strategyFromString(argv[2]) > 0 ? strategyFromString(argv[2]) : First;
+	size_t capacity = size / 64;
+	void **blocks = malloc(capacity * sizeof(void*));
+	int s;
+
+	printf("%zu MB %s pool, times per operation\n", size >> 20, strategy_name(strategy));
+	printf("%-14s %10s %10s %10s %10s\n", "", "setup ms", "malloc ns", "touch ns", "refill ns");
+	for (s = 0; s < sizeof(setups)/sizeof(setups[0]); s++)
+	{
+		struct timespec t0, t1, t2, t3, t4;
+		unsigned int seed = 1;
+		size_t count, i, refilled = 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		initmem_opts(strategy, size, &setups[s].opts);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		for (count = 0; count < capacity; count++)
+		{
+			size_t bytes = 64 + rand_r(&seed) % 4033;
+
+			if ((blocks[count] = mymalloc(bytes)) == NULL)
+				break;
+			*(char*)blocks[count] = 1;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+
+		for (i = 0; i < count; i++)
+			++*(char*)blocks[rand_r(&seed) % count];
+		clock_gettime(CLOCK_MONOTONIC, &t3);
 
-				/* free */
-				force_free = 0;
+		for (i = 0; i < count; i += 2)
+			myfree(blocks[i]);
+		for (i = 0; i < count; i += 2, refilled++)
+			if ((blocks[i] = mymalloc(64 + rand_r(&seed) % 4033)) == NULL)
+				break;
+		clock_gettime(CLOCK_MONOTONIC, &t4);
 
-				if (storedPointers == 0)
-					continue;
+		printf("%-14s %10.2f %10.1f %10.1f %10.1f\n", setups[s].name, elapsed_ns(&t0, &t1) / 1e6,
+			elapsed_ns(&t1, &t2) / (count ? count : 1), elapsed_ns(&t2, &t3) / (count ? count : 1),
+			elapsed_ns(&t3, &t4) / (refilled ? refilled : 1));
+	}
+	free(blocks);
+	return 0;
+}
 
-				chosen = rand() % storedPointers;
-				pointer = pointers[chosen];
-				pointers[chosen] = pointers[storedPointers-1];
+/* what replay_trace saw of a strategy */
+struct replay_result
+{
+	double seconds; /* in the allocator calls alone */
+	size_t failed;
+	double avg_holes, avg_fragmentation; /* fragmentation is the share of free bytes outside the largest free block */
+	int max_holes;
+	size_t peak_allocated;
+};
+
+#define REPLAY_SAMPLE 1024
+
+/* Run every event of a trace against a new pool, as fast as it goes. The pool is sampled
+   for fragmentation every REPLAY_SAMPLE events, outside the timed stretches. Returns 0,
+   or -1 if there is no memory to keep track of the trace's blocks. */
+static int replay_trace(struct trace *t, strategies strategy, size_t poolSize, struct replay_result *r)
+{
+	void **blocks = calloc(t->ids ? t->ids : 1, sizeof(void*));
+	size_t start, i, samples = 0;
+
+	memset(r, 0, sizeof(*r));
+	if (blocks == NULL)
+		return -1;
+	initmem(strategy, poolSize);
+	for (start = 0; start < t->count; start += REPLAY_SAMPLE)
+	{
+		size_t end = start + REPLAY_SAMPLE < t->count ? start + REPLAY_SAMPLE : t->count;
+		struct timespec execstart, execend;
+		size_t free_bytes;
+		int holes;
 
-				storedPointers--;
+		clock_gettime(CLOCK_MONOTONIC, &execstart);
+		for (i = start; i < end; i++)
+		{
+			struct trace_event *e = &t->events[i];
+			void *moved;
 
-				myfree(pointer);
+			switch (e->op)
+			{
+			case TRACE_ALLOC:
+				if ((blocks[e->id] = mymalloc(e->size)) == NULL)
+					r->failed++;
+				break;
+			case TRACE_FREE:
+				if (blocks[e->id])
+					myfree(blocks[e->id]);
+				blocks[e->id] = NULL;
+				break;
+			case TRACE_REALLOC:
+				if (blocks[e->id] && (moved = myrealloc(blocks[e->id], e->size)) != NULL)
+					blocks[e->id] = moved;
+				else if (blocks[e->id])
+					r->failed++;
+				break;
 			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &execend);
+		r->seconds += (execend.tv_sec - execstart.tv_sec) + (execend.tv_nsec - execstart.tv_nsec) / 1e9;
+
+		holes = mem_holes();
+		free_bytes = mem_free();
+		r->avg_holes += holes;
+		r->max_holes = holes > r->max_holes ? holes : r->max_holes;
+		r->avg_fragmentation += free_bytes ? 1 - (double)mem_largest_free() / free_bytes : 0;
+		r->peak_allocated = mem_allocated() > r->peak_allocated ? mem_allocated() : r->peak_allocated;
+		samples++;
+	}
+	if (samples)
+	{
+		r->avg_holes /= samples;
+		r->avg_fragmentation /= samples;
+	}
+	free(blocks);
+	return 0;
+}
+
+/* Replay a trace recorded with mem_trace_start against one strategy or all of them and
+   report the throughput and fragmentation of each. Run as
+   "mem -replay <trace> [strategy|all] [pool size]", by default on the strategy and pool
+   size it was recorded with. */
+int do_replay(int argc, char **argv)
+{
+	struct trace t;
+	strategies strategy, lbound, ubound;
+	size_t poolSize;
+
+	if (argc < 2 || trace_load(argv[1], &t) != 0)
+	{
+		printf("Cannot read a trace from %s\n", argc < 2 ? "nowhere" : argv[1]);
+		return 1;
+	}
+	lbound = ubound = t.strategy;
+	if (argc > 2 && strategyFromString(argv[2]) > 0)
+		lbound = ubound = strategyFromString(argv[2]);
+	else if (argc > 2 && !strcmp(argv[2], "all"))
+	{
+		lbound = 1;
+		ubound = LastStrategy;
+	}
+	poolSize = argc > 3 ? strtoull(argv[3], NULL, 0) : t.poolSize;
 
-			sum_largest_free += mem_largest_free();
-			sum_hole_size += (mem_free() / mem_holes());
-			sum_allocated += mem_allocated();
-			sum_small += mem_small_free(smallBlockSize);
+	printf("%zu events, %llu blocks, %zu byte pool\n", t.count, (unsigned long long)t.ids, poolSize);
+	printf("%-8s %12s %10s %10s %10s %10s %14s\n", "", "ops/s", "failed", "avg holes", "max holes", "frag %", "peak alloc");
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		struct replay_result r;
+
+		if (replay_trace(&t, strategy, poolSize, &r) != 0)
+		{
+			printf("No memory for the %llu blocks of the trace\n", (unsigned long long)t.ids);
+			trace_unload(&t);
+			return 1;
 		}
+		printf("%-8s %12.0f %10zu %10.1f %10d %10.1f %14zu\n", strategy_name(strategy),
+			t.count / (r.seconds > 0 ? r.seconds : 1e-9), r.failed, r.avg_holes, r.max_holes,
+			100 * r.avg_fragmentation, r.peak_allocated);
+	}
+	trace_unload(&t);
+	return 0;
+}
 
-		clock_gettime(CLOCK_REALTIME, &execend);
+/* Run the randomized test with parameters from the command line and print one row of
+   results per strategy and configuration, as CSV or with -json as a JSON array. Run as
+   "mem -stress [-p<pool size>] [-f<fill ratio>] [-s<min size>[-<max size>]] [-n<iterations>]
+   [-r<seed>] [-csv|-json] [strategy|all]". Without any of -p, -f, -s and -n it runs every
+   configuration of the stress test, all strategies and seed 1 by default. */
+int do_stress(int argc, char **argv)
+{
+	struct stress_config single = stress_suite[6];
+	const struct stress_config *configs = stress_suite;
+	size_t count = sizeof(stress_suite)/sizeof(stress_suite[0]), i;
+	strategies strategy, lbound = 1, ubound = LastStrategy;
+	unsigned seed = 1;
+	int json = 0, rows = 0;
+	char *end;
+
+	for (argc--, argv++; argc > 0; argc--, argv++)
+	{
+		char *arg = *argv;
+
+		if (!strcmp(arg, "-json") || !strcmp(arg, "-csv"))
+			json = arg[1] == 'j';
+		else if (arg[0] == '-' && arg[1] == 'p')
+			single.totalSize = strtoull(arg + 2, NULL, 0);
+		else if (arg[0] == '-' && arg[1] == 'f')
+			single.fillRatio = strtod(arg + 2, NULL);
+		else if (arg[0] == '-' && arg[1] == 's')
+		{
+			single.minBlockSize = single.maxBlockSize = strtoull(arg + 2, &end, 0);
+			if (*end == '-')
+				single.maxBlockSize = strtoull(end + 1, NULL, 0);
+		}
+		else if (arg[0] == '-' && arg[1] == 'n')
+			single.iterations = strtol(arg + 2, NULL, 0);
+		else if (arg[0] == '-' && arg[1] == 'r')
+		{
+			seed = strtoul(arg + 2, NULL, 0);
+			continue;
+		}
+		else if (strategyFromString(arg) > 0)
+		{
+			lbound = ubound = strategyFromString(arg);
+			continue;
+		}
+		else if (strcmp(arg, "all"))
+		{
+			printf("Unknown stress option %s\n", arg);
+			return 1;
+		}
+		else
+			continue;
 
-		log = fopen("tests.log","a");
-		if(log == NULL) {
-		  perror("Can't append to log file.\n");
-		  return;
+		if (arg[1] != 'j' && arg[1] != 'c')
+		{
+			configs = &single;
+			count = 1;
 		}
-		
-		fprintf(log,"\t=== %s ===\n",strategy_name(strategy));
-		fprintf(log,"\tTest took %.2fms.\n", (execend.tv_sec - execstart.tv_sec) * 1000 + (execend.tv_nsec - execstart.tv_nsec) / 1000000.0);
-		fprintf(log,"\tAverage hole size: %f\n",sum_hole_size/iterations);
-		fprintf(log,"\tAverage largest free block: %f\n",sum_largest_free/iterations);
-		fprintf(log,"\tAverage allocated bytes: %f\n",sum_allocated/iterations);
-		fprintf(log,"\tAverage number of small blocks: %f\n",sum_small/iterations);
-		fprintf(log,"\tFailed allocations: %d\n",failed_allocations);
-		fclose(log);
+	}
 
+	if (single.totalSize == 0 || single.fillRatio <= 0 || single.fillRatio > 1 ||
+		single.minBlockSize == 0 || single.minBlockSize > single.maxBlockSize || single.iterations < 0)
+	{
+		printf("Need a pool, a fill ratio in (0, 1] and a block size range of at least 1 byte\n");
+		return 1;
+	}
+
+	if (json)
+		printf("[\n");
+	else
+		printf("strategy,pool_size,fill_ratio,min_size,max_size,iterations,seed,ms,ops,ops_per_sec,failed,avg_hole_size,avg_largest_free,avg_allocated,avg_small_blocks\n");
+
+	for (i = 0; i < count; i++)
+	{
+		const struct stress_config *c = &configs[i];
+
+		for (strategy = lbound; strategy <= ubound; strategy++)
+		{
+			struct stress_result r;
+			double rate;
 
+			if (randomized_run(strategy, c, seed, &r) != 0)
+			{
+				printf("Out of memory for the live blocks\n");
+				return 1;
+			}
+			rate = r.ops / (r.seconds > 0 ? r.seconds : 1e-9);
+
+			if (json)
+				printf("%s  {\"strategy\": \"%s\", \"pool_size\": %zu, \"fill_ratio\": %g, \"min_size\": %zu, \"max_size\": %zu, "
+					"\"iterations\": %ld, \"seed\": %u, \"ms\": %.3f, \"ops\": %ld, \"ops_per_sec\": %.0f, \"failed\": %ld, "
+					"\"avg_hole_size\": %f, \"avg_largest_free\": %f, \"avg_allocated\": %f, \"avg_small_blocks\": %f}",
+					rows ? ",\n" : "", strategy_name(strategy), c->totalSize, c->fillRatio, c->minBlockSize, c->maxBlockSize,
+					c->iterations, seed, r.ms, r.ops, rate, r.failed,
+					r.avg_hole_size, r.avg_largest_free, r.avg_allocated, r.avg_small_blocks);
+			else
+				printf("%s,%zu,%g,%zu,%zu,%ld,%u,%.3f,%ld,%.0f,%ld,%f,%f,%f,%f\n",
+					strategy_name(strategy), c->totalSize, c->fillRatio, c->minBlockSize, c->maxBlockSize,
+					c->iterations, seed, r.ms, r.ops, rate, r.failed,
+					r.avg_hole_size, r.avg_largest_free, r.avg_allocated, r.avg_small_blocks);
+			rows++;
+		}
 	}
+	if (json)
+		printf("\n]\n");
+	return 0;
 }
 
 /* run randomized tests against the various strategies with various parameters */
 int do_stress_tests(int argc, char **argv)
 {
 	int strategy = strategyFromString(*(argv+1));
+	unsigned seed = testrunner_seed(); /* logged, mem -test -s<seed> or mem -stress runs it again */
+	size_t i;
 
 	unlink("tests.log");  // We want a new log file
 
-	do_randomized_test(strategy,10000,0.25,1,1000,10000);
-	do_randomized_test(strategy,10000,0.25,1,2000,10000);
-	do_randomized_test(strategy,10000,0.25,1000,2000,10000);
-	do_randomized_test(strategy,10000,0.25,1,3000,10000);
-	do_randomized_test(strategy,10000,0.25,1,4000,10000); 
-	do_randomized_test(strategy,10000,0.25,1,5000,10000);
-
-	do_randomized_test(strategy,10000,0.5,1,1000,10000);
-	do_randomized_test(strategy,10000,0.5,1,2000,10000);
-	do_randomized_test(strategy,10000,0.5,1000,2000,10000);
-	do_randomized_test(strategy,10000,0.5,1,3000,10000); 
-	do_randomized_test(strategy,10000,0.5,1,4000,10000);
-	do_randomized_test(strategy,10000,0.5,1,5000,10000);
-
-	do_randomized_test(strategy,10000,0.5,1000,1000,10000); /* watch what happens with this test!...why? */
-
-	do_randomized_test(strategy,10000,0.75,1,1000,10000);
-	do_randomized_test(strategy,10000,0.75,500,1000,10000);
-	do_randomized_test(strategy,10000,0.75,1,2000,10000); 
-
-	do_randomized_test(strategy,10000,0.9,1,500,10000); 
+	for (i = 0; i < sizeof(stress_suite)/sizeof(stress_suite[0]); i++)
+		do_randomized_test(strategy,&stress_suite[i],seed);
 
 	return 0; /* you nominally pass for surviving without segfaulting */
 }
@@ -263,7 +768,7 @@ int test_alloc_2(int argc, char **argv) {
 				correct_holes = 2;
 				correct_largest_free = 88;
 				break;
-		        case NotSet:
+		        default:
 			        break;
 		}
 
@@ -287,13 +792,13 @@ int test_alloc_2(int argc, char **argv) {
 
 		if (mem_allocated() != correct_alloc)
 		{
-			printf("Memory reported as %d, should be %d with %s\n", mem_allocated(0), correct_alloc, strategy_name(strategy));
+			printf("Memory reported as %zu, should be %d with %s\n", mem_allocated(0), correct_alloc, strategy_name(strategy));
 			return	1;
 		}
 
 		if (mem_largest_free() != correct_largest_free)
 		{
-			printf("Largest memory block free reported as %d, should be %d with %s\n", mem_largest_free(), correct_largest_free, strategy_name(strategy));
+			printf("Largest memory block free reported as %zu, should be %d with %s\n", mem_largest_free(), correct_largest_free, strategy_name(strategy));
 			return	1;
 		}
 
@@ -442,11 +947,1079 @@ int test_alloc_4(int argc, char **argv) {
 }
 
 
+/* alloc, free and coalesce with block headers kept inside the pool */
+int test_headers(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = 4;
+	mem_options opts = { .headers = 1 };
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		char *a, *b, *c;
+		int header;
+
+		initmem_opts(strategy,1000,&opts);
+
+		a = mymalloc(96);
+		b = mymalloc(96);
+		c = mymalloc(96);
+		header = b - (a + 96);
+
+		if (header <= 0 || c != b + 96 + header || a != (char*)mem_pool() + header)
+		{
+			printf("Blocks not laid out back to back with headers with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		if (mem_allocated() != 288 + 4*header)
+		{
+			printf("Allocated memory reported as %zu, should be %d with %s\n", mem_allocated(), 288 + 4*header, strategy_name(strategy));
+			return 1;
+		}
+
+		myfree(b);
+		if (mem_holes() != 2 || mem_is_alloc(b) || !mem_is_alloc(c) || !mem_is_alloc(a))
+		{
+			printf("Freeing middle block failed with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		/* both neighbours of the middle block merge into one hole */
+		myfree(a);
+		myfree(c);
+		if (mem_holes() != 1 || mem_free() != 1000 - header || mem_largest_free() != 1000 - header)
+		{
+			printf("Blocks not coalesced with %s; %d holes, %zu bytes free\n", strategy_name(strategy), mem_holes(), mem_free());
+			return 1;
+		}
+
+		/* odd sizes are rounded up to keep the next header aligned */
+		a = mymalloc(3);
+		b = mymalloc(3);
+		if (!a || !b || (uintptr_t)(a - header) % 8 || (uintptr_t)(b - header) % 8)
+		{
+			printf("Header after an odd sized block not aligned with %s\n", strategy_name(strategy));
+			return 1;
+		}
+		myfree(a);
+		myfree(b);
+
+		/* NULL and addresses outside the pool are no blocks to free */
+		myfree(NULL);
+		myfree(&header);
+		if (mem_check() || mem_holes() != 1)
+		{
+			printf("Freeing no block changed the pool with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		/* the pool can be handed out again as one block */
+		if (mymalloc(1000 - header) != mem_pool() + header)
+		{
+			printf("Coalesced pool could not be reallocated with %s\n", strategy_name(strategy));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* random allocs and frees with every operation verified by mem_check */
+int test_consistency(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = LastStrategy;
+	int headers;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		for (headers = 0; headers <= 1; headers++)
+		{
+			mem_options opts = { .headers = headers, .check = 1 };
+			void *pointers[500];
+			int storedPointers = 0;
+			int i;
+
+			initmem_opts(strategy,20000,&opts);
+			srand(strategy);
+
+			for (i = 0; i < 5000; i++)
+			{
+				if (storedPointers < 500 && rand()%3)
+				{
+					void *pointer = mymalloc(rand()%300+1);
+					if (pointer != NULL)
+						pointers[storedPointers++] = pointer;
+				}
+				else if (storedPointers > 0)
+				{
+					int chosen = rand() % storedPointers;
+					myfree(pointers[chosen]);
+					pointers[chosen] = pointers[--storedPointers];
+				}
+			}
+
+			for (i = 0; i < storedPointers; i++)
+			{
+				void *start = NULL;
+				size_t size = 0;
+
+				/* the last byte of a block leads back to its start */
+				if (mem_block_of(pointers[i], NULL, &size) != 1
+				    || mem_block_of((char*)pointers[i] + size - 1, &start, NULL) != 1 || start != pointers[i])
+				{
+					printf("Block of %p not found with %s\n", pointers[i], strategy_name(strategy));
+					return 1;
+				}
+			}
+
+			while (storedPointers > 0)
+				myfree(pointers[--storedPointers]);
+
+			/* buddy blocks only merge up to the power-of-two blocks the pool was cut into */
+			if ((strategy != Buddy && mem_holes() != 1) || mem_allocated() != mem_total() - mem_free())
+			{
+				printf("Pool not restored after freeing everything with %s\n", strategy_name(strategy));
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+/* buddy blocks are rounded up to powers of two and merge back with their buddies */
+int test_buddy(int argc, char **argv) {
+	void *a, *b, *c, *d;
+
+	initmem(Buddy,1024+512);
+
+	/* the 512 block is the smallest that fits, the rest is split off the 1024 one */
+	d = mymalloc(512);
+	a = mymalloc(100);
+	b = mymalloc(100);
+	c = mymalloc(200);
+
+	if (a != mem_pool() || b != a+128 || c != a+256 || d != a+1024)
+	{
+		printf("Buddy blocks not placed at their power-of-two offsets\n");
+		return 1;
+	}
+
+	if (mem_allocated() != 128+128+256+512 || mem_holes() != 1 || mem_largest_free() != 512)
+	{
+		printf("Buddy reported %zu bytes allocated in %d holes, largest %zu\n", mem_allocated(), mem_holes(), mem_largest_free());
+		return 1;
+	}
+
+	/* a and c are not buddies, freeing both leaves separate holes */
+	myfree(a);
+	myfree(c);
+	if (mem_holes() != 3 || mem_largest_free() != 512 || mymalloc(1024) != NULL)
+	{
+		printf("Non-buddy blocks merged\n");
+		return 1;
+	}
+
+	/* freeing b merges a+b, then with c, then with the other 512 */
+	myfree(b);
+	if (mem_holes() != 1 || mem_largest_free() != 1024 || mem_is_alloc(a) || !mem_is_alloc(d))
+	{
+		printf("Buddies not merged; %d holes, largest %zu\n", mem_holes(), mem_largest_free());
+		return 1;
+	}
+
+	/* the 512 block at the end has no buddy inside the pool */
+	myfree(d);
+	if (mem_holes() != 2 || mem_free() != 1024+512)
+	{
+		printf("Top-level buddy blocks not kept apart\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/* bitmap allocations are rounded up to whole granules */
+int test_bitmap(int argc, char **argv) {
+	mem_options opts = { .granule = 16 };
+	char *a, *b, *c;
+	void *start;
+	size_t size;
+
+	initmem_opts(Bitmap,1000,&opts);
+
+	/* 62 granules, the last 8 bytes do not fill one */
+	if (mem_free() != 992 || mem_allocated() != 8)
+	{
+		printf("Bitmap reported %zu bytes free, %zu allocated\n", mem_free(), mem_allocated());
+		return 1;
+	}
+
+	a = mymalloc(1);
+	b = mymalloc(17);
+	c = mymalloc(100);
+	if (a != mem_pool() || b != a+16 || c != a+48)
+	{
+		printf("Bitmap blocks not rounded to granules\n");
+		return 1;
+	}
+
+	myfree(b);
+	if (mem_holes() != 2 || mem_small_free(32) != 1 || mem_largest_free() != 992-160)
+	{
+		printf("Bitmap reported %d holes, largest %zu\n", mem_holes(), mem_largest_free());
+		return 1;
+	}
+
+	if (mem_block_of(b+20, &start, &size) != 0 || start != b || size != 32
+	    || mem_block_of(c+100, &start, &size) != 1 || start != c || size != 112)
+	{
+		printf("Bitmap blocks not found from inner pointers\n");
+		return 1;
+	}
+
+	/* the freed run is reused first */
+	if (mymalloc(32) != b)
+	{
+		printf("Bitmap did not fill the first free run\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/* fixed-size requests served from a slab that fills the pool exactly */
+int test_slab(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = LastStrategy;
+	size_t sizes[] = { 8, 1000, 0 };
+	mem_options opts = { .slabs = 1, .slab_sizes = sizes, .slab_objects = 10, .check = 1 };
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		void *pointers[10];
+		void *small;
+		int i;
+
+		/* buddy blocks are powers of two, give it room for a 16384 byte slab */
+		initmem_opts(strategy,strategy == Buddy ? 16384 : 10000,&opts);
+
+		for (i = 0; i < 10; i++)
+		{
+			pointers[i] = mymalloc(900 + i);
+			if (pointers[i] != mem_pool() + 1000*i)
+			{
+				printf("Object %d not placed in the slab with %s\n", i, strategy_name(strategy));
+				return 1;
+			}
+		}
+
+		/* the slab takes the whole pool, nothing is left for another one */
+		if (mymalloc(1000) != NULL || mymalloc(5) != NULL)
+		{
+			printf("Allocation succeeded in a full pool with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		/* freed objects are handed out again, last freed first */
+		myfree(pointers[3]);
+		myfree(pointers[7]);
+		if (mymalloc(1000) != pointers[7] || mymalloc(999) != pointers[3])
+		{
+			printf("Freed objects not reused with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		/* the empty slab is kept, until its space is needed for something else */
+		for (i = 0; i < 10; i++)
+			myfree(pointers[i]);
+		small = mymalloc(8);
+		if (small == NULL || mem_is_alloc(mem_pool()) == 0)
+		{
+			printf("Empty slab not given up for another class with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		myfree(small);
+	}
+
+	return 0;
+}
+
+
+/* 1 if the first n bytes of block still hold the pattern filled in by fill_pattern */
+static int has_pattern(void *block, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (((unsigned char*)block)[i] != (unsigned char)(i*7))
+			return 0;
+	return 1;
+}
+
+static void fill_pattern(void *block, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		((unsigned char*)block)[i] = (unsigned char)(i*7);
+}
+
+/* realloc keeps the contents, and resizes in place or into a neighbour before it copies */
+int test_realloc(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = LastStrategy;
+	int headers;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		for (headers = 0; headers <= 1; headers++)
+		{
+			mem_options opts = { .headers = headers, .check = 1 };
+			mem_realloc_stats stats;
+			void *a, *b, *c, *r;
+
+			initmem_opts(strategy,4096,&opts);
+			a = mymalloc(300);
+			b = mymalloc(300);
+			c = mymalloc(300);
+			fill_pattern(b,300);
+
+			if (strategy == Buddy)
+			{
+				/* b is a 512 byte block (headers included): halving it is in place, outgrowing it is not */
+				if (myrealloc(b,20) != b || !has_pattern(b,20) || (r = myrealloc(b,600)) == b || !has_pattern(r,20))
+				{
+					printf("Buddy realloc misplaced with headers %d\n", headers);
+					return 1;
+				}
+				mem_realloc_counts(&stats);
+				if (stats.shrunk != 1 || stats.copied != 1)
+				{
+					printf("Buddy realloc counted wrong with headers %d\n", headers);
+					return 1;
+				}
+				continue;
+			}
+
+			/* shrinking gives up the tail, growing takes it back */
+			if (myrealloc(b,100) != b || !has_pattern(b,100) || mem_is_alloc((char*)b + 250))
+			{
+				printf("Realloc did not shrink in place with %s\n", strategy_name(strategy));
+				return 1;
+			}
+			fill_pattern(b,100);
+			if (myrealloc(b,300) != b || !has_pattern(b,100))
+			{
+				printf("Realloc did not grow in place with %s\n", strategy_name(strategy));
+				return 1;
+			}
+
+			if (strategy == Bitmap)
+			{
+				/* bitmap blocks only grow forwards, b has to be copied past c */
+				myfree(a);
+				r = myrealloc(b,500);
+				mem_realloc_counts(&stats);
+				if (r == NULL || r <= c || !has_pattern(r,100) || stats.shrunk != 1 || stats.grown != 1 || stats.copied != 1)
+				{
+					printf("Bitmap realloc misplaced\n");
+					return 1;
+				}
+				continue;
+			}
+
+			/* with c in the way, b moves down into the space a left */
+			myfree(a);
+			r = myrealloc(b,500);
+			if (r != a || !has_pattern(r,100) || !mem_is_alloc(c))
+			{
+				printf("Realloc did not move into the previous block with %s\n", strategy_name(strategy));
+				return 1;
+			}
+
+			/* neither neighbour has room for this one */
+			b = myrealloc(r,1200);
+			if (b == NULL || b <= c || !has_pattern(b,100) || mem_is_alloc(r))
+			{
+				printf("Realloc did not copy with %s\n", strategy_name(strategy));
+				return 1;
+			}
+			if (myrealloc(b,5000) != NULL || !has_pattern(b,100))
+			{
+				printf("Oversized realloc changed the block with %s\n", strategy_name(strategy));
+				return 1;
+			}
+
+			mem_realloc_counts(&stats);
+			if (stats.shrunk != 1 || stats.grown != 1 || stats.moved != 1 || stats.copied != 1)
+			{
+				printf("Realloc paths counted wrong with %s: %ld %ld %ld %ld\n", strategy_name(strategy),
+				       stats.shrunk, stats.grown, stats.moved, stats.copied);
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* blocks of mymemalign and of pools with an alignment start where they should */
+int test_align(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = LastStrategy;
+	int headers;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		for (headers = 0; headers <= 1; headers++)
+		{
+			mem_options opts = { .headers = headers, .check = 1 };
+			mem_options aligned = { .headers = headers, .check = 1, .alignment = 64, .slabs = 1 };
+			size_t alignment;
+			void *pointers[20];
+			void *odd;
+			int i;
+
+			initmem_opts(strategy,1<<14,&opts);
+			odd = mymalloc(3);
+			/* with the longest free run known, an aligned block from the middle of it must shorten it */
+			mem_largest_free();
+
+			/* buddy blocks cannot have their bytes aligned past an in-band header */
+			for (alignment = 16; alignment <= 1024 && !(strategy == Buddy && headers); alignment *= 4)
+			{
+				void *block = mymemalign(alignment,100);
+				size_t size = 0;
+
+				if (block == NULL || (uintptr_t)block % alignment || mem_block_of(block,NULL,&size) != 1 || size < 100 || mem_check())
+				{
+					printf("Block not aligned to %zu with %s\n", alignment, strategy_name(strategy));
+					return 1;
+				}
+				myfree(block);
+			}
+			if (mymemalign(24,100) != NULL)
+			{
+				printf("Alignment that is no power of two accepted with %s\n", strategy_name(strategy));
+				return 1;
+			}
+
+			/* the padding in front of an aligned block is given back with it */
+			myfree(odd);
+			if ((strategy != Buddy && mem_holes() != 1) || mem_allocated() != mem_total() - mem_free())
+			{
+				printf("Aligned blocks left fragments behind with %s\n", strategy_name(strategy));
+				return 1;
+			}
+
+			/* a pool-wide alignment holds for every block, slabs included */
+			initmem_opts(strategy,1<<16,&aligned);
+			for (i = 0; i < 20; i++)
+			{
+				pointers[i] = mymalloc(i*13 + 1);
+				if (pointers[i] == NULL || (uintptr_t)pointers[i] % 64)
+				{
+					printf("Block %d not aligned to the pool with %s\n", i, strategy_name(strategy));
+					return 1;
+				}
+			}
+			for (i = 0; i < 20; i++)
+				myfree(pointers[i]);
+
+			/* everything came back, the empty slabs once they are needed */
+			if (mymalloc(40000) == NULL)
+			{
+				printf("Aligned blocks not freed with %s\n", strategy_name(strategy));
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* compaction moves handle blocks together, keeping their contents, and leaves pinned ones in place */
+int test_compact(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = LastStrategy;
+	int headers;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		for (headers = 0; headers <= 1; headers++)
+		{
+			mem_options opts = { .headers = headers, .check = 1 };
+			int moves = strategy != Buddy && strategy != Bitmap;
+			handle_t handles[16];
+			void *pinned;
+			size_t empty;
+			int calls, i, j;
+
+			initmem_opts(strategy,1<<14,&opts);
+			/* in-band headers count as allocated */
+			empty = mem_allocated();
+			for (i = 0; i < 16; i++)
+			{
+				unsigned char *block;
+
+				handles[i] = myhalloc(200);
+				if (handles[i] == 0 || (block = hderef(handles[i])) == NULL)
+				{
+					printf("No handle block with %s\n", strategy_name(strategy));
+					return 1;
+				}
+				for (j = 0; j < 200; j++)
+					block[j] = (unsigned char)(i*31 + j);
+			}
+			for (i = 0; i < 16; i += 2)
+				hfree(handles[i]);
+			pinned = hpin(handles[5]);
+
+			/* with no time to spare every call takes a single step */
+			for (calls = 1; !mem_compact(0); calls++)
+				;
+			if (moves && (calls < 2 || mem_holes() != 2))
+			{
+				printf("Compaction took %d calls and left %d holes with %s\n", calls, mem_holes(), strategy_name(strategy));
+				return 1;
+			}
+			if (hderef(handles[5]) != pinned)
+			{
+				printf("Pinned block moved with %s\n", strategy_name(strategy));
+				return 1;
+			}
+
+			hunpin(handles[5]);
+			mem_compact(1000000);
+			if (moves && mem_holes() != 1)
+			{
+				printf("Unpinned block not compacted with %s\n", strategy_name(strategy));
+				return 1;
+			}
+			for (i = 1; i < 16; i += 2)
+			{
+				unsigned char *block = hderef(handles[i]);
+
+				for (j = 0; j < 200; j++)
+					if (block[j] != (unsigned char)(i*31 + j))
+					{
+						printf("Block %d lost its contents in compaction with %s\n", i, strategy_name(strategy));
+						return 1;
+					}
+			}
+
+			for (i = 1; i < 16; i += 2)
+				hfree(handles[i]);
+			if (hderef(handles[1]) != NULL || mem_allocated() != empty)
+			{
+				printf("Handle blocks not freed with %s\n", strategy_name(strategy));
+				return 1;
+			}
+
+			/* a plain block that realloc moves into where a handle block was is no handle block */
+			if (moves)
+			{
+				void *x, *p, *start = NULL;
+				handle_t h;
+
+				initmem_opts(strategy,4096,&opts);
+				x = mymalloc(64);
+				h = myhalloc(100);
+				p = mymalloc(100);
+				mymalloc(3000);
+				hfree(h);
+				p = myrealloc(p,150);
+				h = myhalloc(20);
+				myfree(x);
+				mem_compact(1000000);
+				if (mem_check() || mem_block_of(p,&start,NULL) != 1 || start != p || hderef(h) == p)
+				{
+					printf("Reallocated block taken for a handle block with %s\n", strategy_name(strategy));
+					return 1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+/* a pool with a reserve grows to fit what is allocated and shrinks back once it is freed,
+   and a pool mapped with any kind of pages works like any other */
+int test_grow(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = LastStrategy;
+	int headers;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		for (headers = 0; headers <= 1; headers++)
+		{
+			mem_options opts = { .headers = headers, .check = 1, .reserve = 1<<24 };
+			mem_options paged = { .headers = headers, .check = 1, .huge_pages = 1, .populate = 1, .numa_nodes = 1 };
+			int grows = strategy != Buddy && strategy != Bitmap;
+			void *pointers[64];
+			size_t start;
+			int i;
+
+			initmem_opts(strategy,4096,&opts);
+			start = mem_total();
+			if (mem_reserved() != (grows ? 1<<24 : start))
+			{
+				printf("Reserved %zu bytes with %s\n", mem_reserved(), strategy_name(strategy));
+				return 1;
+			}
+
+			for (i = 0; i < 64; i++)
+			{
+				pointers[i] = mymalloc(4000);
+				if ((grows && pointers[i] == NULL) || mem_total() > mem_reserved())
+				{
+					printf("Block %d missing with %s\n", i, strategy_name(strategy));
+					return 1;
+				}
+				if (pointers[i])
+					memset(pointers[i], i, 4000);
+			}
+			if ((grows && mymalloc(1<<24) != NULL) || mem_total() > (grows ? 1<<24 : start))
+			{
+				printf("Pool grew past its reserve with %s\n", strategy_name(strategy));
+				return 1;
+			}
+
+			for (i = 0; i < 64; i++)
+				if (pointers[i])
+					myfree(pointers[i]);
+			if (mem_total() != start || mem_holes() != 1)
+			{
+				printf("Pool kept %zu bytes after the frees with %s\n", mem_total(), strategy_name(strategy));
+				return 1;
+			}
+
+			/* pages of another kind make no difference to what the pool does */
+			initmem_opts(strategy,1<<20,&paged);
+			pointers[0] = mymalloc(1000);
+			if (pointers[0] == NULL || mem_total() != 1<<20)
+			{
+				printf("No pool with huge, populated, bound pages with %s\n", strategy_name(strategy));
+				return 1;
+			}
+			memset(pointers[0], 1, 1000);
+			myfree(pointers[0]);
+		}
+	}
+	return 0;
+}
+
+/* a pool past 4 GB, with blocks, offsets and totals no 32-bit size can hold */
+int test_large(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = LastStrategy;
+	size_t pool = (size_t)5 << 30, first = (size_t)4 << 30, second = (size_t)1 << 29;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		mem_options opts = { .granule = 4096 };
+		char *a, *b, *start = NULL;
+		size_t size = 0;
+
+		initmem_opts(strategy,pool,&opts);
+		if (mem_pool() == NULL)
+		{
+			printf("No room for a %zu byte pool, skipped\n", pool);
+			return 0;
+		}
+
+		a = mymalloc(first);
+		b = mymalloc(second);
+		if (a == NULL || b == NULL || b - (char*)mem_pool() < first)
+		{
+			printf("No blocks past 4 GB with %s\n", strategy_name(strategy));
+			return 1;
+		}
+		/* only the pages touched here are ever faulted in */
+		a[0] = a[first - 1] = b[0] = b[second - 1] = 1;
+
+		if (mem_allocated() != first + second || mem_largest_free() != pool - first - second
+		    || mem_block_of(b + second - 1, (void**)&start, &size) != 1 || start != b || size != second
+		    || mem_small_free((size_t)1 << 33) != mem_holes())
+		{
+			printf("Sizes past 4 GB wrapped with %s: %zu allocated, largest free %zu\n", strategy_name(strategy), mem_allocated(), mem_largest_free());
+			return 1;
+		}
+		if (mymalloc(pool + 1) != NULL || mymalloc((size_t)-1) != NULL || mymemalign((size_t)1 << 63, 1) != NULL)
+		{
+			printf("Request larger than the pool met with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		myfree(a);
+		myfree(b);
+		if (mem_free() != pool || mem_total() != pool || mem_check() != 0)
+		{
+			printf("Pool not back to %zu free bytes with %s\n", pool, strategy_name(strategy));
+			return 1;
+		}
+	}
+	initmem(First,1);
+	return 0;
+}
+
+/* a batch comes from one free block where there is one, and a batch free merges the lot */
+int test_batch(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = LastStrategy;
+	int config;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		for (config = 0; config < 3; config++)
+		{
+			mem_options opts = { .headers = config == 1, .slabs = config == 2, .check = 1 };
+			int carves = strategy != Buddy && strategy != Bitmap && config != 2;
+			size_t sizes[100], huge[2] = { 100, 1<<20 };
+			void *pointers[100], *shuffled[100];
+			size_t empty, size;
+			int i, j;
+
+			initmem_opts(strategy,1<<16,&opts);
+			empty = mem_allocated();
+			for (i = 0; i < 100; i++)
+				sizes[i] = 16 + i*37 % 300;
+
+			if (mymalloc_batch(sizes,100,pointers) != 100 || (carves && mem_holes() != 1))
+			{
+				printf("Batch not allocated in one piece with %s\n", strategy_name(strategy));
+				return 1;
+			}
+			for (i = 0; i < 100; i++)
+			{
+				if (pointers[i] == NULL || mem_block_of(pointers[i],NULL,&size) != 1 || size < sizes[i])
+				{
+					printf("Batch block %d too small with %s\n", i, strategy_name(strategy));
+					return 1;
+				}
+				memset(pointers[i], i, sizes[i]);
+			}
+			for (i = 0; i < 100; i++)
+				for (j = 0; j < sizes[i]; j++)
+					if (((unsigned char*)pointers[i])[j] != i)
+					{
+						printf("Batch blocks %d and another overlap with %s\n", i, strategy_name(strategy));
+						return 1;
+					}
+
+			/* all of it or nothing */
+			if (mymalloc_batch(huge,2,shuffled) != 0 || shuffled[0] != NULL || shuffled[1] != NULL)
+			{
+				printf("Batch too large for the pool allocated with %s\n", strategy_name(strategy));
+				return 1;
+			}
+
+			/* in no particular order, with gaps and a block given twice */
+			for (i = 0; i < 100; i++)
+				shuffled[i] = pointers[(i*31) % 100];
+			shuffled[50] = NULL;
+			myfree_batch(shuffled,100);
+			if (!mem_is_alloc(pointers[(50*31) % 100]))
+			{
+				printf("Batch free freed a block it was not given with %s\n", strategy_name(strategy));
+				return 1;
+			}
+			shuffled[0] = shuffled[1] = pointers[(50*31) % 100];
+			myfree_batch(shuffled,2);
+			/* slab classes keep an empty slab each */
+			if (mem_check() != 0 || (config != 2 && (mem_allocated() != empty || (strategy != Buddy && mem_holes() != 1))))
+			{
+				printf("Batch free left %zu bytes in %d holes with %s\n", mem_allocated(), mem_holes(), strategy_name(strategy));
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* a recorded trace holds every call, and replaying it on the same strategy ends in the same pool */
+int test_trace(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = LastStrategy;
+	const char *path = "tests.trace";
+	const char stray[] = "MTRC\1\x80\x80\x04\3\2\0\xff\xff\xff\xff\xff\xff\xff\xff\x7f";
+	struct trace t;
+	FILE *f;
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		struct replay_result r;
+		void *pointers[50], *stale;
+		size_t allocated;
+		int holes, i;
+
+		initmem(strategy,1<<16);
+		stale = mymalloc(10);
+		if (mem_trace_start(path) != 0)
+		{
+			printf("Cannot record to %s\n", path);
+			return 1;
+		}
+		/* frees of blocks from before the recording are left out */
+		myfree(stale);
+		for (i = 0; i < 50; i++)
+			pointers[i] = mymalloc(20 + i*13);
+		for (i = 0; i < 50; i += 5)
+			pointers[i] = myrealloc(pointers[i], 400);
+		for (i = 1; i < 50; i += 2)
+			myfree(pointers[i]);
+		mem_trace_stop();
+		holes = mem_holes();
+		allocated = mem_allocated();
+
+		if (trace_load(path, &t) != 0 || t.count != 50 + 10 + 25 || t.ids != 50 || t.poolSize != 1<<16
+		    || t.strategy != strategy || t.events[0].op != TRACE_ALLOC || t.events[0].size != 20
+		    || t.events[50].op != TRACE_REALLOC || t.events[60].op != TRACE_FREE || t.events[60].id != 1)
+		{
+			printf("Trace does not hold the calls made with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		if (replay_trace(&t, strategy, t.poolSize, &r) != 0 || r.failed != 0 || mem_holes() != holes || mem_allocated() != allocated)
+		{
+			printf("Replay ended in %d holes, %zu bytes allocated, not %d, %zu with %s\n", mem_holes(), mem_allocated(), holes, allocated, strategy_name(strategy));
+			return 1;
+		}
+		trace_unload(&t);
+	}
+
+	/* a trace freeing a block it never allocated, with an id too large to keep track of, is no trace */
+	if ((f = fopen(path, "wb")) == NULL)
+		return 1;
+	fwrite(stray, 1, sizeof(stray) - 1, f);
+	fclose(f);
+	if (trace_load(path, &t) != -1)
+	{
+		printf("Trace with a stray id accepted\n");
+		return 1;
+	}
+	unlink(path);
+	return 0;
+}
+
+/* arenas are pools of their own, independent of each other and of the default pool */
+int test_arenas(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = LastStrategy;
+	mem_options opts = { .thread_cache = 1, .check = 1 };
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		arena_t *a, *b;
+		void *pa, *pb, *pd;
+
+		initmem(strategy,1024);
+		pd = mymalloc(100);
+
+		a = arena_create(strategy,1024);
+		b = arena_create_opts(strategy,2048,&opts);
+		pa = arena_malloc(a,300);
+		pb = arena_malloc(b,300);
+
+		if (pa != arena_pool(a) || pb != arena_pool(b) || pd != mem_pool())
+		{
+			printf("Blocks not placed in their own arena with %s\n", strategy_name(strategy));
+			return 1;
+		}
+		if (arena_total(b) != 2048 || arena_free_bytes(a) != arena_total(a) - arena_allocated(a) || arena_holes(a) != 1)
+		{
+			printf("Arena statistics wrong with %s\n", strategy_name(strategy));
+			return 1;
+		}
+		if (!arena_is_alloc(a,pa) || arena_check(a) || arena_check(b))
+		{
+			printf("Arena state inconsistent with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		/* a freed block is kept for this thread and handed out again for its class */
+		arena_free(b,pb);
+		if (arena_malloc(b,strategy == Buddy ? 512 : 256) != pb || arena_check(b))
+		{
+			printf("Freed block not cached with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		/* queries see the blocks this thread has cached as free */
+		arena_free(b,pb);
+		if (arena_allocated(b) != 0 || arena_is_alloc(b,pb) || arena_check(b))
+		{
+			printf("Cached block still counted as allocated with %s\n", strategy_name(strategy));
+			return 1;
+		}
+		pb = arena_malloc(b,300);
+
+		/* b caches the block, destroying b must leave the cache harmless */
+		arena_free(b,pb);
+		arena_destroy(b);
+		arena_free(a,pa);
+		if (arena_is_alloc(a,pa) || arena_allocated(a) != 0)
+		{
+			printf("Arena block not freed with %s\n", strategy_name(strategy));
+			return 1;
+		}
+		arena_destroy(a);
+
+		/* the default pool saw none of it */
+		if (!mem_is_alloc(pd) || mem_check())
+		{
+			printf("Default pool disturbed by arenas with %s\n", strategy_name(strategy));
+			return 1;
+		}
+		myfree(pd);
+	}
+
+	return 0;
+}
+
+struct remote_freer
+{
+	arena_t *arena;
+	void **pointers;
+	int count;
+};
+
+static void *remote_free_worker(void *arg)
+{
+	struct remote_freer *f = arg;
+	int i;
+
+	for (i = 0; i < f->count; i++)
+		arena_free(f->arena, f->pointers[i]);
+	return NULL;
+}
+
+/* blocks freed by other threads wait in the owner's queue until the owner allocates again */
+int test_remote(int argc, char **argv) {
+	strategies strategy;
+	int lbound = 1;
+	int ubound = LastStrategy;
+	mem_options opts = { .remote_free = 1 };
+
+	if (strategyFromString(*(argv+1))>0)
+		lbound=ubound=strategyFromString(*(argv+1));
+
+	for (strategy = lbound; strategy <= ubound; strategy++)
+	{
+		arena_t *a = arena_create_opts(strategy,1<<16,&opts);
+		void *pointers[400];
+		pthread_t ids[4];
+		struct remote_freer freers[4];
+		int allocated, i;
+
+		for (i = 0; i < 400; i++)
+		{
+			/* 1 byte requests must still hold the queue link */
+			pointers[i] = arena_malloc(a, i % 2 ? 1 : 100);
+			if (pointers[i] == NULL)
+			{
+				printf("Allocation %d failed with %s\n", i, strategy_name(strategy));
+				return 1;
+			}
+		}
+		allocated = arena_allocated(a);
+
+		for (i = 0; i < 4; i++)
+		{
+			freers[i] = (struct remote_freer){ a, pointers + 100*i, 100 };
+			pthread_create(&ids[i], NULL, remote_free_worker, &freers[i]);
+		}
+		for (i = 0; i < 4; i++)
+			pthread_join(ids[i], NULL);
+
+		if (arena_allocated(a) != allocated || arena_check(a))
+		{
+			printf("Remote frees not deferred to the owner with %s\n", strategy_name(strategy));
+			return 1;
+		}
+
+		/* the next allocation frees all of them at once */
+		pointers[0] = arena_malloc(a, 100);
+		arena_free(a, pointers[0]);
+		if (arena_allocated(a) != 0 || arena_check(a))
+		{
+			printf("Remote frees not done by the owner with %s\n", strategy_name(strategy));
+			return 1;
+		}
+		arena_destroy(a);
+	}
+
+	return 0;
+}
+
+/* the randomized test from several threads at once, up to twice the cores there are */
+int test_threads(int argc, char **argv) {
+	int strategy = strategyFromString(*(argv+1));
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	int maxThreads = cores < 2 ? 4 : cores > 32 ? 64 : cores * 2;
+
+	if (do_threaded_test(strategy,1<<20,0.5,1,1000,20000,maxThreads))
+		return 1;
+	return do_threaded_test(strategy,1<<20,0.5,8,64,20000,maxThreads);
+}
+
+
 int run_memory_tests(int argc, char **argv)
 {
 	if (argc < 3)
 	{
-	        printf("Usage: mem -test <test> <strategy> \n");
+	        printf("Usage: mem -test [-fN] [-r] [-jN] [-sN] <test> <strategy> \n");
 		return 0;
 	}
 	set_testrunner_default_timeout(20);
@@ -456,7 +2029,22 @@ int run_memory_tests(int argc, char **argv)
 		{"alloc2","suite2",test_alloc_2},
 		{"alloc3","suite1",test_alloc_3},
 		{"alloc4","suite2",test_alloc_4},
-		{"stress","suite3",do_stress_tests},
+		{"headers","suite2",test_headers},
+		{"consistency","suite3",test_consistency,1},
+		{"buddy","suite4",test_buddy},
+		{"bitmap","suite4",test_bitmap},
+		{"slab","suite4",test_slab},
+		{"realloc","suite2",test_realloc},
+		{"align","suite2",test_align},
+		{"arenas","suite2",test_arenas},
+		{"compact","suite2",test_compact},
+		{"batch","suite2",test_batch},
+		{"trace","suite2",test_trace},
+		{"grow","suite2",test_grow},
+		{"threads","suite3",test_threads,1},
+		{"large","suite3",test_large},
+		{"remote","suite3",test_remote},
+		{"stress","suite3",do_stress_tests,1},
 	};
 
  	return run_testrunner(argc,argv,tests,sizeof(tests)/sizeof(testentry_t));
@@ -465,16 +2053,24 @@ int run_memory_tests(int argc, char **argv)
 int main(int argc, char **argv)
 {
   if( argc < 2) {
-    printf("Usage: mem -test <test> <strategy> | mem -try <arg1> <arg2> ... \n");
+    printf("Usage: mem -test <test> <strategy> | mem -try <arg1> <arg2> ... | mem -pagebench [megabytes] [strategy] | mem -replay <trace> [strategy] [pool size] | mem -bench [strategy] [benchmark] | mem -stress [options] [strategy]\n");
     exit(-1);
   }
   else if (!strcmp(argv[1],"-test"))
     return run_memory_tests(argc-1,argv+1);
+  else if (!strcmp(argv[1],"-bench"))
+    return run_benchmarks(argc-1,argv+1);
+  else if (!strcmp(argv[1],"-stress"))
+    return do_stress(argc-1,argv+1);
+  else if (!strcmp(argv[1],"-replay"))
+    return do_replay(argc-1,argv+1);
+  else if (!strcmp(argv[1],"-pagebench"))
+    return do_page_bench(argc-1,argv+1);
   else if (!strcmp(argv[1],"-try")) {
     try_mymem(argc-1,argv+1);
     return 0;
   } else {
-    printf("Usage: mem -test <test> <strategy> | mem -try <arg1> <arg2> ... \n");
+    printf("Usage: mem -test <test> <strategy> | mem -try <arg1> <arg2> ... | mem -pagebench [megabytes] [strategy] | mem -replay <trace> [strategy] [pool size] | mem -bench [strategy] [benchmark] | mem -stress [options] [strategy]\n");
     exit(-1);
   }
 
@@ -2,8 +2,17 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "mymem.h"
+#include "rbtree.h"
+#include "bitmap.h"
+#include "slab.h"
+#include "trace.h"
 #include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 /* The main structure for implementing memory allocation.
  * You may change this to fit your implementation.
@@ -15,286 +24,2952 @@ struct memoryList
     struct memoryList *last;
     struct memoryList *next;
 
-    int size;   // How many bytes in this block?
+    size_t size; // How many bytes in this block?
     char alloc; // 1 if this block is allocated,
                 // 0 if this block is free.
     void *ptr;  // location of block in memory pool.
+
+    // free block index links, which one is in use depends on the strategy
+    union
+    {
+        // size-class bin
+        struct
+        {
+            struct memoryList *binPrev;
+            struct memoryList *binNext;
+        };
+        // tree of free blocks ordered by (size, ptr), or of a First fit bin ordered by ptr
+        struct rb_node sizeNode;
+    };
+    int heapIndex; // slot in the largest-free heap while the block is free
+    int handle;    // handle of an allocated block that may be moved, 0 if none
+
+    struct rb_node addrNode; // tree of all blocks ordered by ptr
 };
 
-struct memoryList *firstBlock(size_t requested);
-struct memoryList *bestBlock(size_t requested);
-struct memoryList *worstBlock(size_t requested);
-struct memoryList *nextBlock(size_t requested);
+#define BIN_COUNT 64
 
-strategies myStrategy = NotSet; // Current strategy
+// a slot of the handle table, see Handles and compaction
+struct handleSlot
+{
+    void *ptr;    // current address of the block, NULL while the slot is free
+    int pins;     // the block does not move while this is above 0
+    int nextFree; // next free slot while this one is free, -1 for none
+};
 
-size_t mySize;
-void *myMemory = NULL;
+/* Everything that describes one pool. The functions of the mymem_* API work
+ * on the default arena, arena_* on any arena made with arena_create.
+ */
+struct arena
+{
+    strategies myStrategy; // Current strategy
+
+    size_t mySize;
+    void *myMemory;
+    size_t reserved;    // address space the pool may grow into, 0 for a pool that does not grow
+    size_t initialSize; // a growable pool does not shrink below this
+    size_t mapLength;   // bytes mapped for the pool, 0 if it was malloced
+    int hugePages;
+    int populate;
+
+    // the whole pool with the Bitmap strategy, which keeps no memoryList at all
+    struct bitmap_pool bitmapPool;
+
+    // small requests are served from here first when the pool was set up with slabs
+    struct slab_cache slabCache;
+    int useSlabs;
+
+    struct memoryList *head;
+    struct memoryList *next; // where the next fit search resumes
+
+    // Bytes of pool used by each block for its in-band header, 0 if nodes live outside the pool
+    size_t blockOverhead;
+
+    // every block starts at a multiple of this, see below
+    size_t alignment;
+
+    // 1 to verify all bookkeeping after every mymalloc and myfree
+    int checkMode;
+
+    // every block, free or allocated, by address
+    struct rb_root addrTree;
+
+    // locking, see below
+    pthread_mutex_t poolLock;
+    pthread_mutex_t slabLock;
+    int locksReady;
+
+    // how often realloc took each path
+    mem_realloc_stats reallocs;
+
+    // handles, see below
+    struct handleSlot *handles;
+    int handleCount;
+    int freeHandle;    // first free slot, -1 for none
+    void *compactFrom; // where the next compaction step starts, NULL for the start of the pool
+
+    // remote frees, see below
+    int useRemoteFree;
+    pthread_t owner;
+    void *remoteFrees; // blocks freed by other threads, linked through their first bytes
+
+    // thread caches, see below
+    int useThreadCache;
+    unsigned long id;       // never reused, so a cache can tell this arena from one made later
+    struct arena *nextLive; // list of all arenas that have not been destroyed
+
+    // node pool, see below
+    struct nodeChunk *chunks;         // every chunk ever allocated, oldest first
+    struct nodeChunk *currentChunk;   // chunk new nodes are bumped from
+    size_t chunkUsed;                 // nodes of currentChunk handed out so far
+    struct memoryList *releasedNodes; // free list, linked through next
+
+    // free block index, see below
+    struct memoryList *bins[BIN_COUNT]; // first block of each bin, the lowest one if ordered
+    unsigned long long binMap; // bit k set if bins[k] is non-empty
+    int useBins;               // 1 if the current strategy searches the bins
+    int binsOrdered;           // 1 to keep bins in address order, otherwise new blocks go first
+    struct rb_root binTrees[BIN_COUNT]; // the bins by address, when ordered
+
+    struct rb_root sizeTree; // free blocks by (size, ptr)
+    int useSizeTree;         // 1 if the current strategy searches the tree
+
+    size_t freeBytes; // sum of the sizes of all free blocks
+
+    int sizeHistogram[BIN_COUNT]; // free blocks per power-of-two size class
+    int *sizeCounts;              // Fenwick tree of free blocks by exact size, 1..sizeCountsLimit
+    size_t sizeCountsLimit;
+
+    struct memoryList **freeHeap; // max-heap of all free blocks on size, lowest address on ties
+    int heapCount;
+    int heapCapacity;
+
+    // buddy system, see below
+    int buddyMinOrder;
+    unsigned char *buddyBits;
+    size_t buddyBitBase[BIN_COUNT]; // first bit of each order's pairs
+    size_t buddyTail;               // bytes at the end of the pool not in any block
+};
 
-static struct memoryList *head;
-static struct memoryList *next;
-struct memoryList *trav; // memory list traversal pointer
+// the pool of initmem, mymalloc, myfree and the mem_* queries
+static arena_t defaultArena;
+
+struct memoryList *firstBlock(arena_t *a, size_t requested);
+struct memoryList *bestBlock(arena_t *a, size_t requested);
+struct memoryList *worstBlock(arena_t *a, size_t requested);
+struct memoryList *nextBlock(arena_t *a, size_t requested);
+struct memoryList *buddyBlock(arena_t *a, size_t requested);
+void buddyFree(arena_t *a, struct memoryList *block);
+
+static void addrInsert(arena_t *a, struct memoryList *node);
+static struct memoryList *headerOf(arena_t *a, void *block);
+static struct memoryList *findBlock(arena_t *a, void *block);
+static int binOf(size_t size);
+static void buddyInit(arena_t *a);
+static void *poolMalloc(arena_t *a, size_t requested);
+static struct memoryList *searchBlock(arena_t *a, size_t requested);
+static void *poolMemalign(arena_t *a, size_t alignment, size_t requested);
+static void *poolAllocate(arena_t *a, size_t alignment, size_t requested);
+static void *takeBlock(arena_t *a, struct memoryList *memBlock, size_t requested);
+static void poolFree(arena_t *a, void *block);
+static int checkPool(arena_t *a);
+static void arenaInit(arena_t *a, strategies strategy, size_t sz, const mem_options *opts);
+static void releasePool(arena_t *a);
+
+/****** Locking ******
+ * In every arena one recursive lock guards the pool and everything indexing
+ * it, the slab layer has a lock of its own that is taken before the pool
+ * lock whenever a slab is carved or given back. initmem, arena_create and
+ * arena_destroy must not run concurrently with other calls on their arena.
+ *
+ * The pool lock is deliberately coarse. Splitting a block or merging it
+ * with its neighbours touches the block ring, the address tree, the size
+ * tree, the heap, the bins and the size counters in one go, so a lock per
+ * index would always be taken all together, in a fixed order, on every
+ * call. The thread caches are what keeps most calls off the lock instead.
+ *
+ * The list of live arenas has a lock of its own, taken before any arena's.
+ */
+static pthread_mutex_t arenasLock = PTHREAD_MUTEX_INITIALIZER;
+static arena_t *liveArenas;
+static unsigned long lastArenaId;
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
 
-/* initmem must be called prior to mymalloc and myfree.
+static void lockPool(arena_t *a)
+{
+    pthread_mutex_lock(&a->poolLock);
+}
 
-   initmem may be called more than once in a given exeuction;
-   when this occurs, all memory you previously malloc'ed  *must* be freed,
-   including any existing bookkeeping data.
+static void unlockPool(arena_t *a)
+{
+    pthread_mutex_unlock(&a->poolLock);
+}
 
-   strategy must be one of the following:
-        - "best" (best-fit)
-        - "worst" (worst-fit)
-        - "first" (first-fit)
-        - "next" (next-fit)
-   sz specifies the number of bytes that will be available, in total, for all mymalloc requests.
-*/
+static void initLocks(arena_t *a)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&a->poolLock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_mutex_init(&a->slabLock, NULL);
+    a->locksReady = 1;
+}
 
-void initmem(strategies strategy, size_t sz)
+/* Give the arena a fresh id and put it on the live list, if it is not there yet. */
+static void registerArena(arena_t *a)
 {
-    myStrategy = strategy;
+    arena_t *i;
 
-    /* all implementations will need an actual block of memory to use */
-    mySize = sz;
+    pthread_mutex_lock(&arenasLock);
+    a->id = ++lastArenaId;
+    for (i = liveArenas; i && i != a; i = i->nextLive)
+        ;
+    if (!i)
+    {
+        a->nextLive = liveArenas;
+        liveArenas = a;
+    }
+    pthread_mutex_unlock(&arenasLock);
+}
+
+static void unregisterArena(arena_t *a)
+{
+    arena_t **i;
 
-    if (myMemory != NULL)
-        free(myMemory); /* in case this is not the first time initmem2 is called */
+    pthread_mutex_lock(&arenasLock);
+    for (i = &liveArenas; *i; i = &(*i)->nextLive)
+    {
+        if (*i == a)
+        {
+            *i = a->nextLive;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&arenasLock);
+}
 
-    // Release any other memory you were using for bookkeeping when doing a re-initialization!
+/****** Thread caches ******
+ * With thread caches on, myfree keeps small blocks in a per-thread cache
+ * instead of giving them back, and mymalloc hands them out again without
+ * taking any lock. A cached block stays allocated as far as the pool is
+ * concerned. Blocks are filed by size: a block of 2^k to 2^(k+1)-1 bytes goes
+ * to class k, and a request of at most 2^k bytes is served from class k.
+ *
+ * A thread caches blocks of one arena at a time, named by the arena's id.
+ * Freeing into another arena first gives the cached blocks back to theirs,
+ * looked up by id among the live arenas, so blocks of an arena that was
+ * destroyed or re-initialised meanwhile are just forgotten.
+ *
+ * The size of a freed block is read from its header when headers are
+ * in-band. Otherwise freed blocks are kept unsorted first, and their sizes
+ * are looked up under one taking of the pool lock once CACHE_DEPTH of them
+ * have gathered or an allocation finds no block to take, so the free path
+ * is lock-free either way. Unsorted blocks count as cached, and those too
+ * large to cache go back to the pool when they are sorted.
+ *
+ * The queries (mem_free, mem_holes, mem_check and the like) first give the
+ * calling thread's cached blocks back, so a thread sees its own frees. The
+ * caches of other threads still count as allocated until those threads
+ * flush them with mem_thread_flush or exit.
+ */
+
+#define CACHE_CLASSES 11 // blocks below 2^CACHE_CLASSES bytes are cached
+#define CACHE_DEPTH 16   // blocks per class and thread
+
+struct threadCache
+{
+    unsigned long arenaId; // id of the arena the blocks belong to, 0 for none
+    int count[CACHE_CLASSES];
+    void *blocks[CACHE_CLASSES][CACHE_DEPTH];
+    int unsorted;
+    void *unsortedBlocks[CACHE_DEPTH]; // freed blocks whose size is not known yet
+};
+
+static __thread struct threadCache myCache;
+static pthread_key_t cacheKey; // only there for its destructor, flushing a thread's cache as it exits
+
+/* Give every cached block back to the arena it came from and empty the cache. */
+static void flushCache(struct threadCache *cache)
+{
+    arena_t *a;
+    int c;
 
-    // check if there is at least one block allocated in memory
-    if (head != NULL)
+    pthread_mutex_lock(&arenasLock);
+    for (a = liveArenas; a && a->id != cache->arenaId; a = a->nextLive)
+        ;
+    if (a)
     {
-        // traverse the doubly linked list
-        for (trav = head; trav->next != NULL; trav = trav->next)
+        lockPool(a);
+        for (c = 0; c < CACHE_CLASSES; c++)
         {
-            // free previous node in memory
-            free(trav->last);
+            while (cache->count[c] > 0)
+            {
+                poolFree(a, cache->blocks[c][--cache->count[c]]);
+            }
         }
-        // finally free the traversal pointer
-        free(trav);
+        while (cache->unsorted > 0)
+        {
+            poolFree(a, cache->unsortedBlocks[--cache->unsorted]);
+        }
+        unlockPool(a);
     }
+    pthread_mutex_unlock(&arenasLock);
 
-    myMemory = malloc(sz);
+    memset(cache->count, 0, sizeof(cache->count));
+    cache->unsorted = 0;
+    cache->arenaId = 0;
+}
 
-    // Initialize memory management structure.
+static void threadExit(void *cache)
+{
+    flushCache(cache);
+}
 
-    // init first node of memory, from https://github.com/ArmandasRokas/dtu_notes/wiki/ass3_manual
-    head = (struct memoryList *)malloc(sizeof(struct memoryList));
-    head->last = head;
-    head->next = head;
-    head->size = sz;      // initialy the first block size is equals to the memory pool size.
-    head->alloc = 0;      // not allocated
-    head->ptr = myMemory; // points to the same memory adress as the memory pool
-    next = head;          // only used for next fit
+static void createCacheKey()
+{
+    pthread_key_create(&cacheKey, threadExit);
+}
+
+/* The calling thread's cache, set up to hold blocks of arena a. */
+static struct threadCache *threadCache(arena_t *a)
+{
+    if (myCache.arenaId != a->id)
+    {
+        if (myCache.arenaId)
+        {
+            flushCache(&myCache);
+        }
+        myCache.arenaId = a->id;
+        pthread_setspecific(cacheKey, &myCache);
+    }
+    return &myCache;
+}
+
+/* Give the calling thread's cached blocks of a back before a query. Call with the pool unlocked. */
+static void flushOwnCache(arena_t *a)
+{
+    if (myCache.arenaId == a->id)
+    {
+        flushCache(&myCache);
+    }
+}
+
+/* Size of an allocated block of a starting at block, 0 if there is none. Call with the pool locked. */
+static size_t lockedBlockSize(arena_t *a, void *block)
+{
+    size_t size = 0;
+
+    if (a->myStrategy == Bitmap)
+    {
+        void *start;
+        if (bitmap_block_of(&a->bitmapPool, block, &start, &size) != 1 || start != block)
+        {
+            size = 0;
+        }
+    }
+    else
+    {
+        struct memoryList *node = findBlock(a, block);
+        size = node && node->alloc ? node->size : 0;
+    }
+    return size;
+}
+
+/* File a block of the given size in its class. Returns 0 if it does not fit. */
+static int fileBlock(struct threadCache *cache, void *block, size_t size)
+{
+    int c;
+
+    if (size == 0 || size >= (1 << CACHE_CLASSES))
+    {
+        return 0;
+    }
+    c = binOf(size);
+    if (cache->count[c] == CACHE_DEPTH)
+    {
+        return 0;
+    }
+    cache->blocks[c][cache->count[c]++] = block;
+    return 1;
+}
+
+/* File the unsorted blocks by size under a single taking of the lock, giving back those that do not fit. */
+static void sortCache(arena_t *a, struct threadCache *cache)
+{
+    lockPool(a);
+    while (cache->unsorted > 0)
+    {
+        void *block = cache->unsortedBlocks[--cache->unsorted];
+
+        if (!fileBlock(cache, block, lockedBlockSize(a, block)))
+        {
+            poolFree(a, block);
+        }
+    }
+    unlockPool(a);
+}
+
+/* A cached block for the requested size, NULL if this thread has none. */
+static void *cachedBlock(arena_t *a, size_t requested)
+{
+    int c = requested <= 1 ? 0 : 64 - __builtin_clzll(requested - 1);
+
+    // blocks of other arenas are not given up for a mere allocation
+    if (c >= CACHE_CLASSES || myCache.arenaId != a->id)
+    {
+        return NULL;
+    }
+    if (myCache.count[c] == 0 && myCache.unsorted > 0)
+    {
+        // about to take the lock for the pool anyway
+        sortCache(a, &myCache);
+    }
+    return myCache.count[c] > 0 ? myCache.blocks[c][--myCache.count[c]] : NULL;
+}
+
+/* Keep a block that is being freed in this thread's cache. Returns 0 if it does not fit. */
+static int cacheBlock(arena_t *a, void *block)
+{
+    struct threadCache *cache = threadCache(a);
+
+    if (a->blockOverhead)
+    {
+        // the header is right in front of the block, no lookup needed
+        struct memoryList *node = headerOf(a, block);
+        return node && node->alloc && fileBlock(cache, block, node->size);
+    }
+
+    if (cache->unsorted == CACHE_DEPTH)
+    {
+        sortCache(a, cache);
+    }
+    cache->unsortedBlocks[cache->unsorted++] = block;
+    return 1;
+}
+
+/****** Alignment ******
+ * With a pool-wide alignment, the pool itself starts aligned and every
+ * request and in-band header is rounded up to a multiple of the alignment,
+ * so every block (but the last) ends where an aligned one can start. No
+ * block needs padding in front of it then. Blocks asked for with a larger
+ * alignment start on the first such address in a free block, the free bytes
+ * in front of it stay behind as a free block of their own.
+ */
+
+// the pool always starts on a page, which keeps buddy blocks up to that size aligned as well
+#define POOL_ALIGNMENT 4096
+
+static size_t alignUp(size_t size, size_t alignment)
+{
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+/* 1 if no block of size bytes can ever fit the pool. Sizes that can are
+ * far enough from SIZE_MAX for any header, rounding or padding added to them.
+ */
+static int tooLarge(arena_t *a, size_t size)
+{
+    return size > (a->reserved ? a->reserved : a->mySize);
+}
+
+/****** Remote frees ******
+ * With remote frees on, an arena belongs to one thread, the one that set it
+ * up. A block freed by any other thread is not given back there and then but
+ * pushed onto the arena's queue, a stack linked through the blocks' own first
+ * bytes that is pushed to with a compare-and-swap and taken whole with one
+ * exchange, so neither side ever waits for the other. The owner takes the
+ * queue on its next allocation and frees the lot under a single lock, so
+ * merging free blocks only ever happens on the owning thread.
+ *
+ * Every block needs room for the link, so requests are rounded up to the
+ * size of a pointer. Blocks need not be aligned for one, so the link is
+ * copied in and out bytewise.
+ */
+
+static void pushRemoteFree(arena_t *a, void *block)
+{
+    void *top = __atomic_load_n(&a->remoteFrees, __ATOMIC_RELAXED);
+
+    do
+    {
+        memcpy(block, &top, sizeof(top));
+    } while (!__atomic_compare_exchange_n(&a->remoteFrees, &top, block, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Free everything on the queue of a. */
+static void drainRemoteFrees(arena_t *a)
+{
+    void *block = __atomic_exchange_n(&a->remoteFrees, NULL, __ATOMIC_ACQUIRE);
+
+    if (!block)
+    {
+        return;
+    }
+
+    if (a->useSlabs)
+    {
+        pthread_mutex_lock(&a->slabLock);
+    }
+    lockPool(a);
+    while (block)
+    {
+        void *following;
+
+        memcpy(&following, block, sizeof(following));
+
+        if (!a->useSlabs || !slab_free(&a->slabCache, block))
+        {
+            poolFree(a, block);
+        }
+        block = following;
+    }
+    unlockPool(a);
+    if (a->useSlabs)
+    {
+        pthread_mutex_unlock(&a->slabLock);
+    }
+}
+
+/****** Node pool ******
+ * Out-of-band nodes are carved from chunks of contiguous nodes instead of
+ * being malloc'ed one at a time. Released nodes go on a free list, new ones
+ * are bumped off the current chunk, and a fresh chunk (twice the size of the
+ * last) is only malloc'ed once all chunks are used up. The chunks outlive
+ * initmem: a re-initialisation just rewinds the pool to the first chunk.
+ */
+
+#define FIRST_CHUNK_NODES 256
+
+struct nodeChunk
+{
+    struct nodeChunk *next;
+    size_t count; // nodes in this chunk
+    struct memoryList nodes[];
+};
+
+static struct memoryList *poolNode(arena_t *a)
+{
+    struct memoryList *node = a->releasedNodes;
+
+    if (node)
+    {
+        a->releasedNodes = node->next;
+        return node;
+    }
+
+    if (!a->currentChunk || a->chunkUsed == a->currentChunk->count)
+    {
+        if (a->currentChunk && a->currentChunk->next)
+        {
+            // reuse a chunk left over from before the last reset
+            a->currentChunk = a->currentChunk->next;
+        }
+        else
+        {
+            size_t count = a->currentChunk ? 2 * a->currentChunk->count : FIRST_CHUNK_NODES;
+            struct nodeChunk *chunk = malloc(sizeof(struct nodeChunk) + count * sizeof(struct memoryList));
+
+            chunk->next = NULL;
+            chunk->count = count;
+            if (a->currentChunk)
+            {
+                a->currentChunk->next = chunk;
+            }
+            else
+            {
+                a->chunks = chunk;
+            }
+            a->currentChunk = chunk;
+        }
+        a->chunkUsed = 0;
+    }
+
+    return &a->currentChunk->nodes[a->chunkUsed++];
+}
+
+/* Forget every node handed out, keeping the chunks for reuse. */
+static void resetNodePool(arena_t *a)
+{
+    a->currentChunk = a->chunks;
+    a->chunkUsed = 0;
+    a->releasedNodes = NULL;
+}
+
+/* Create the node for a block whose region starts at the given pool address.
+ * With in-band headers the node is placed at that address and the block's
+ * bytes follow it; otherwise the node comes from the node pool.
+ */
+static struct memoryList *newNode(arena_t *a, void *at)
+{
+    struct memoryList *node;
+
+    if (a->blockOverhead)
+    {
+        node = (struct memoryList *)at;
+    }
+    else
+    {
+        node = poolNode(a);
+    }
+    node->ptr = (char *)at + a->blockOverhead;
+    node->handle = 0;
+    addrInsert(a, node);
+    return node;
+}
+
+/* Release a node that is no longer part of the ring. */
+static void deleteNode(arena_t *a, struct memoryList *node)
+{
+    rb_erase(&a->addrTree, &node->addrNode);
+    if (!a->blockOverhead)
+    {
+        node->next = a->releasedNodes;
+        a->releasedNodes = node;
+    }
+}
+
+/* First pool address covered by a block, including its header. */
+static char *blockStart(arena_t *a, struct memoryList *node)
+{
+    return (char *)node->ptr - a->blockOverhead;
+}
+
+/****** Free block index ******
+ * Free blocks are kept in power-of-two size-class bins: bin k holds the free
+ * blocks of 2^k to 2^(k+1)-1 bytes, and bit k of binMap is set while bin k is
+ * non-empty. A search starts at the bin of the requested size and never looks
+ * at allocated blocks. Buddy only needs any block of a bin, its bins are
+ * lists with new blocks in front. First fit needs the lowest, so its bins are
+ * red-black trees by address, with the lowest block kept at hand: a free
+ * costs O(log n) in the blocks of its bin rather than a walk along them.
+ *
+ * Best fit instead keeps its free blocks in a red-black tree ordered by
+ * (size, address), where the smallest fitting block is one descent away.
+ *
+ * Independent of the strategy, all free blocks are also in an indexable
+ * max-heap on size, so the largest free block (Worst fit, mem_largest_free)
+ * is always at the top. The heap doubles as the hole count, and together with
+ * the running freeBytes total it answers the mem_* queries without a walk.
+ *
+ * Free block sizes are also counted in a log2 histogram, and sizes up to
+ * SIZE_TREE_LIMIT in a Fenwick tree over exact sizes, for mem_small_free.
+ */
+
+#define SIZE_TREE_LIMIT 65536
+
+static int binOf(size_t size)
+{
+    return 63 - __builtin_clzll(size);
+}
+
+static void binInsert(arena_t *a, struct memoryList *node)
+{
+    int bin = binOf(node->size);
+    struct memoryList *first = a->bins[bin];
+
+    if (a->binsOrdered)
+    {
+        struct rb_node **link = &a->binTrees[bin].node, *parent = NULL;
+
+        while (*link)
+        {
+            parent = *link;
+            link = node->ptr < rb_entry(parent, struct memoryList, sizeNode)->ptr ? &parent->left : &parent->right;
+        }
+        rb_link(&node->sizeNode, parent, link);
+        rb_insert_fixup(&a->binTrees[bin], &node->sizeNode);
+        if (first && first->ptr < node->ptr)
+        {
+            return;
+        }
+    }
+    else
+    {
+        node->binPrev = NULL;
+        node->binNext = first;
+        if (first)
+        {
+            first->binPrev = node;
+        }
+    }
+    a->bins[bin] = node;
+    a->binMap |= 1ULL << bin;
+}
+
+/* The block after i in its bin, in address order. */
+static struct memoryList *binNext(struct memoryList *i)
+{
+    struct rb_node *after = rb_next(&i->sizeNode);
+
+    return after ? rb_entry(after, struct memoryList, sizeNode) : NULL;
+}
+
+static void binRemove(arena_t *a, struct memoryList *node)
+{
+    int bin = binOf(node->size);
+
+    if (a->binsOrdered)
+    {
+        if (a->bins[bin] == node)
+        {
+            a->bins[bin] = binNext(node);
+        }
+        rb_erase(&a->binTrees[bin], &node->sizeNode);
+    }
+    else
+    {
+        if (node->binNext)
+        {
+            node->binNext->binPrev = node->binPrev;
+        }
+        if (node->binPrev)
+        {
+            node->binPrev->binNext = node->binNext;
+        }
+        else
+        {
+            a->bins[bin] = node->binNext;
+        }
+    }
+    if (!a->bins[bin])
+    {
+        a->binMap &= ~(1ULL << bin);
+    }
+}
+
+static void sizeTreeInsert(arena_t *a, struct memoryList *node)
+{
+    struct rb_node **link = &a->sizeTree.node, *parent = NULL;
+
+    while (*link)
+    {
+        struct memoryList *i = rb_entry(*link, struct memoryList, sizeNode);
+
+        parent = *link;
+        if (node->size < i->size || (node->size == i->size && node->ptr < i->ptr))
+        {
+            link = &parent->left;
+        }
+        else
+        {
+            link = &parent->right;
+        }
+    }
+
+    rb_link(&node->sizeNode, parent, link);
+    rb_insert_fixup(&a->sizeTree, &node->sizeNode);
+}
+
+/* Add delta to the number of free blocks of the given size. */
+static void countSize(arena_t *a, size_t size, int delta)
+{
+    a->sizeHistogram[binOf(size)] += delta;
+    for (; size <= a->sizeCountsLimit; size += size & -size)
+    {
+        a->sizeCounts[size] += delta;
+    }
+}
+
+/* Number of free blocks of at most size bytes, size <= sizeCountsLimit. */
+static int countSizesUpTo(arena_t *a, size_t size)
+{
+    int count = 0;
+
+    for (; size > 0; size -= size & -size)
+    {
+        count += a->sizeCounts[size];
+    }
+    return count;
+}
+
+/* 1 if a belongs above b in the heap */
+static int heapAbove(struct memoryList *x, struct memoryList *y)
+{
+    return x->size > y->size || (x->size == y->size && x->ptr < y->ptr);
+}
+
+static void heapPlace(arena_t *a, struct memoryList *node, int index)
+{
+    a->freeHeap[index] = node;
+    node->heapIndex = index;
+}
+
+static void heapUp(arena_t *a, int index)
+{
+    struct memoryList *node = a->freeHeap[index];
+
+    while (index > 0 && heapAbove(node, a->freeHeap[(index - 1) / 2]))
+    {
+        heapPlace(a, a->freeHeap[(index - 1) / 2], index);
+        index = (index - 1) / 2;
+    }
+    heapPlace(a, node, index);
+}
+
+static void heapDown(arena_t *a, int index)
+{
+    struct memoryList *node = a->freeHeap[index];
+    int child;
+
+    while ((child = 2 * index + 1) < a->heapCount)
+    {
+        if (child + 1 < a->heapCount && heapAbove(a->freeHeap[child + 1], a->freeHeap[child]))
+        {
+            child++;
+        }
+        if (!heapAbove(a->freeHeap[child], node))
+        {
+            break;
+        }
+        heapPlace(a, a->freeHeap[child], index);
+        index = child;
+    }
+    heapPlace(a, node, index);
+}
+
+static void heapInsert(arena_t *a, struct memoryList *node)
+{
+    if (a->heapCount == a->heapCapacity)
+    {
+        a->heapCapacity = a->heapCapacity ? 2 * a->heapCapacity : 64;
+        a->freeHeap = realloc(a->freeHeap, a->heapCapacity * sizeof(*a->freeHeap));
+    }
+    heapPlace(a, node, a->heapCount++);
+    heapUp(a, node->heapIndex);
+}
+
+static void heapRemove(arena_t *a, struct memoryList *node)
+{
+    int index = node->heapIndex;
+    struct memoryList *last = a->freeHeap[--a->heapCount];
+
+    if (last != node)
+    {
+        // move the last leaf into the hole, then restore order in whichever direction it broke
+        heapPlace(a, last, index);
+        heapUp(a, index);
+        heapDown(a, last->heapIndex);
+    }
+}
+
+/* Bitmap of the non-empty bins above bin. */
+static unsigned long long binsAbove(arena_t *a, int bin)
+{
+    return bin >= BIN_COUNT - 1 ? 0 : a->binMap & (~0ULL << (bin + 1));
+}
+
+/* Register a block that just became free, at its final size. */
+static void indexFree(arena_t *a, struct memoryList *node)
+{
+    if (a->useBins)
+    {
+        binInsert(a, node);
+    }
+    else if (a->useSizeTree)
+    {
+        sizeTreeInsert(a, node);
+    }
+    heapInsert(a, node);
+    a->freeBytes += node->size;
+    countSize(a, node->size, 1);
+}
+
+/* Unregister a free block before it is allocated, resized or merged away. */
+static void unindexFree(arena_t *a, struct memoryList *node)
+{
+    if (a->useBins)
+    {
+        binRemove(a, node);
+    }
+    else if (a->useSizeTree)
+    {
+        rb_erase(&a->sizeTree, &node->sizeNode);
+    }
+    heapRemove(a, node);
+    a->freeBytes -= node->size;
+    countSize(a, node->size, -1);
+}
+
+/****** Address index ******
+ * All blocks are also kept in a red-black tree ordered by address, so the
+ * block enclosing any pool address is found in O(log n).
+ */
+
+static void addrInsert(arena_t *a, struct memoryList *node)
+{
+    struct rb_node **link = &a->addrTree.node, *parent = NULL;
+
+    while (*link)
+    {
+        parent = *link;
+        if (node->ptr < rb_entry(parent, struct memoryList, addrNode)->ptr)
+        {
+            link = &parent->left;
+        }
+        else
+        {
+            link = &parent->right;
+        }
+    }
+
+    rb_link(&node->addrNode, parent, link);
+    rb_insert_fixup(&a->addrTree, &node->addrNode);
+}
+
+/* The block whose bytes (header included) cover ptr, the first block for
+ * addresses in front of the pool and the last block for those past it.
+ */
+static struct memoryList *enclosingBlock(arena_t *a, void *ptr)
+{
+    struct rb_node *n = a->addrTree.node;
+    struct memoryList *found = a->head;
+
+    // rightmost block starting at or before ptr
+    while (n)
+    {
+        struct memoryList *i = rb_entry(n, struct memoryList, addrNode);
+
+        if (blockStart(a, i) <= (char *)ptr)
+        {
+            found = i;
+            n = n->right;
+        }
+        else
+        {
+            n = n->left;
+        }
+    }
+
+    return found;
+}
+
+/* The in-band header in front of block, NULL if block cannot have one: outside
+ * the pool, NULL included, or not where a header would leave it. Needs no lock.
+ */
+static struct memoryList *headerOf(arena_t *a, void *block)
+{
+    uintptr_t at = (uintptr_t)block, base = (uintptr_t)a->myMemory;
+    struct memoryList *cont;
+
+    if (at < base + a->blockOverhead || at >= base + __atomic_load_n(&a->mySize, __ATOMIC_RELAXED)
+        || at % _Alignof(struct memoryList))
+    {
+        return NULL;
+    }
+    cont = (struct memoryList *)(at - a->blockOverhead);
+    return cont->ptr == block ? cont : NULL;
+}
+
+/* Find the node of the block handed out at address block, NULL if there is none. */
+static struct memoryList *findBlock(arena_t *a, void *block)
+{
+    struct memoryList *cont;
+
+    if (a->blockOverhead)
+    {
+        // the header sits right in front of the block
+        return headerOf(a, block);
+    }
+
+    cont = enclosingBlock(a, block);
+    return cont->ptr == block ? cont : NULL;
+}
+
+/* Split the bytes of node past its first keep bytes off into a new free block
+ * following it in the ring. The new block is not indexed yet.
+ */
+static struct memoryList *splitOff(arena_t *a, struct memoryList *node, size_t keep)
+{
+    struct memoryList *remainder = newNode(a, (char *)node->ptr + keep);
+
+    // insert remainder into the memory
+    remainder->next = node->next;
+    remainder->next->last = remainder;
+    remainder->last = node;
+    node->next = remainder;
+
+    // divide memory
+    remainder->size = node->size - keep - a->blockOverhead;
+    remainder->alloc = 0;
+    node->size = keep;
+    return remainder;
+}
+
+/* Merge the block following node into node. The merged away block must not be indexed. */
+static void absorbNext(arena_t *a, struct memoryList *node)
+{
+    struct memoryList *latter = node->next;
+
+    node->next = latter->next;
+    node->next->last = node;
+    node->size += a->blockOverhead + latter->size;
+
+    if (a->next == latter)
+    {
+        a->next = node;
+    }
+
+    deleteNode(a, latter);
+}
+
+/****** Pool memory ******
+ * A pool is one aligned malloc, unless one of the options below asks for
+ * more control over its pages; then it is mapped directly:
+ *  - huge_pages backs it with 2 MB pages, from the pages the system has set
+ *    aside for that (MAP_HUGETLB) if there are enough, else by asking for
+ *    transparent huge pages (MADV_HUGEPAGE) on a mapping aligned for them.
+ *  - populate faults every page in up front, not on first touch.
+ *  - numa_nodes binds the pages to those NUMA nodes (mbind).
+ *
+ * A pool set up with a reserve is mapped as one range of reserve bytes of
+ * address space with no access, of which only the front is made usable:
+ * the pool proper, mySize bytes. When an allocation finds no room the pool
+ * grows, at least doubling, by making the next pages of the range usable
+ * and adding them to the last block. When a free leaves enough free pages
+ * at the end of the pool, they are given back to the system and made
+ * unusable again, but the pool never shrinks below the size it started at.
+ *
+ * Buddy and Bitmap pools cannot grow, their bookkeeping is sized for the
+ * pool at the start; they ignore the reserve.
+ */
+
+// free bytes at the end of a growable pool worth giving back
+#define POOL_TRIM (64 * 1024)
+#define HUGE_PAGE (2 * 1024 * 1024)
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+
+/* Bytes a mapped pool is sized, grows and shrinks by a multiple of. */
+static size_t growStep(arena_t *a)
+{
+    size_t page = a->hugePages ? HUGE_PAGE : (size_t)sysconf(_SC_PAGESIZE);
+
+    return a->alignment > page ? a->alignment : page;
+}
+
+/* Fault in the pages of a usable range of the pool. */
+static void prefault(char *start, size_t length)
+{
+    size_t page = sysconf(_SC_PAGESIZE), i;
+
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(start, length, MADV_POPULATE_WRITE) == 0)
+    {
+        return;
+    }
+#endif
+    // the pages are all zeroes still, writing one keeps them so
+    for (i = 0; i < length; i += page)
+    {
+        ((volatile char *)start)[i] = 0;
+    }
+}
+
+/* Map length bytes starting at a multiple of step, NULL if that fails. */
+static char *mapAligned(size_t length, size_t step, int prot, int flags)
+{
+    char *map, *start;
+
+    // map more, so that a range starting on a step can be cut out
+    map = mmap(NULL, length + step, prot, flags, -1, 0);
+    if (map == MAP_FAILED)
+    {
+        return NULL;
+    }
+    start = (char *)alignUp((uintptr_t)map, step);
+    if (start > map)
+    {
+        munmap(map, start - map);
+    }
+    munmap(start + length, map + step - start);
+    return start;
+}
+
+/* Take the memory for a pool of sz bytes, configured by opts. */
+static void reservePool(arena_t *a, size_t sz, const mem_options *opts)
+{
+    size_t reserve = opts ? opts->reserve : 0;
+    unsigned long nodes = opts ? opts->numa_nodes : 0;
+    int growable = reserve > sz && a->myStrategy != Buddy && a->myStrategy != Bitmap;
+    int prot = growable ? PROT_NONE : PROT_READ | PROT_WRITE;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | (growable ? MAP_NORESERVE : 0);
+    // pages faulted in before they are bound or made huge would be in the wrong place or small
+    int populateNow = !growable && !nodes && opts && opts->populate;
+    int populated = 0;
+    size_t step, length;
+    char *start = NULL;
+
+    a->reserved = a->mapLength = 0;
+    a->hugePages = opts && opts->huge_pages;
+    a->populate = opts && opts->populate;
+    if (!growable && !a->hugePages && !a->populate && !nodes)
+    {
+        if (posix_memalign(&a->myMemory, a->alignment > POOL_ALIGNMENT ? a->alignment : POOL_ALIGNMENT, sz))
+        {
+            a->myMemory = NULL;
+        }
+        return;
+    }
+
+    step = growStep(a);
+    length = alignUp(growable ? reserve : sz, step);
+    if (a->hugePages)
+    {
+        // huge page mappings start on a huge page anyway
+        start = mmap(NULL, length, prot, flags | MAP_HUGETLB | (populateNow ? MAP_POPULATE : 0), -1, 0);
+        start = start == MAP_FAILED ? NULL : start;
+        populated = start && populateNow;
+    }
+    if (!start)
+    {
+        populateNow = populateNow && !a->hugePages;
+        start = mapAligned(length, step, prot, flags | (populateNow ? MAP_POPULATE : 0));
+        populated = start && populateNow;
+        if (start && a->hugePages)
+        {
+            madvise(start, length, MADV_HUGEPAGE);
+        }
+    }
+    a->myMemory = start;
+    if (!start)
+    {
+        return;
+    }
+    a->mapLength = length;
+
+    if (nodes)
+    {
+        // a binding that fails leaves the pages wherever the kernel puts them;
+        // the kernel takes one bit less of the mask than it is told
+        syscall(SYS_mbind, start, length, MPOL_BIND, &nodes, sizeof(nodes) * 8 + 1, 0);
+    }
+
+    if (growable)
+    {
+        a->reserved = length;
+        a->initialSize = a->mySize = alignUp(sz, step);
+        if (mprotect(start, a->mySize, PROT_READ | PROT_WRITE))
+        {
+            releasePool(a);
+            return;
+        }
+    }
+    if (a->populate && !populated)
+    {
+        prefault(start, a->mySize);
+    }
+}
+
+/* Give the memory of a pool back, however it was taken. */
+static void releasePool(arena_t *a)
+{
+    if (a->mapLength)
+    {
+        munmap(a->myMemory, a->mapLength);
+    }
+    else
+    {
+        free(a->myMemory);
+    }
+    a->myMemory = NULL;
+    a->mapLength = 0;
+}
+
+/* Grow the pool enough for a block of needed bytes, which may need a
+ * header of its own, to fit at its end. Returns 0 if the reserve is used up.
+ */
+static int growPool(arena_t *a, size_t needed)
+{
+    struct memoryList *last;
+    size_t grow;
+    char *end;
+
+    if (!a->reserved || a->mySize == a->reserved)
+    {
+        return 0;
+    }
+
+    // doubling keeps the number of times a pool grows down to a few
+    grow = alignUp(needed + a->blockOverhead, growStep(a));
+    grow = grow > a->mySize ? grow : a->mySize;
+    grow = grow < a->reserved - a->mySize ? grow : a->reserved - a->mySize;
+
+    end = (char *)a->myMemory + a->mySize;
+    if (mprotect(end, grow, PROT_READ | PROT_WRITE))
+    {
+        return 0;
+    }
+    if (a->populate)
+    {
+        prefault(end, grow);
+    }
+    // read without the lock by headerOf
+    __atomic_store_n(&a->mySize, a->mySize + grow, __ATOMIC_RELAXED);
+
+    last = a->head->last;
+    if (!last->alloc)
+    {
+        unindexFree(a, last);
+        last->size += grow;
+    }
+    else
+    {
+        last = newNode(a, end);
+        last->size = grow - a->blockOverhead;
+        last->alloc = 0;
+        last->last = a->head->last;
+        last->next = a->head;
+        a->head->last->next = last;
+        a->head->last = last;
+    }
+    indexFree(a, last);
+    return 1;
+}
+
+/* Give the free pages at the end of a growable pool back, if there are enough of them. */
+static void trimPool(arena_t *a)
+{
+    struct memoryList *last = a->head->last;
+    char *end = (char *)a->myMemory + a->mySize, *keep;
+
+    if (!a->reserved || last->alloc)
+    {
+        return;
+    }
+
+    // the last block keeps at least a byte
+    keep = (char *)alignUp((uintptr_t)last->ptr + 1, growStep(a));
+    if (keep < (char *)a->myMemory + a->initialSize)
+    {
+        keep = (char *)a->myMemory + a->initialSize;
+    }
+    if (keep >= end || end - keep < POOL_TRIM)
+    {
+        return;
+    }
+
+    unindexFree(a, last);
+    last->size -= end - keep;
+    indexFree(a, last);
+    madvise(keep, end - keep, MADV_DONTNEED);
+    mprotect(keep, end - keep, PROT_NONE);
+    __atomic_store_n(&a->mySize, keep - (char *)a->myMemory, __ATOMIC_RELAXED);
+}
+
+/* initmem must be called prior to mymalloc and myfree.
+
+   initmem may be called more than once in a given exeuction;
+   when this occurs, all memory you previously malloc'ed  *must* be freed,
+   including any existing bookkeeping data.
+
+   strategy must be one of the following:
+        - "best" (best-fit)
+        - "worst" (worst-fit)
+        - "first" (first-fit)
+        - "next" (next-fit)
+        - "buddy" (binary buddy system)
+        - "bitmap" (first fit over a bit array of granules)
+   sz specifies the number of bytes that will be available, in total, for all mymalloc requests.
+*/
+
+void initmem(strategies strategy, size_t sz)
+{
+    initmem_opts(strategy, sz, NULL);
+}
+
+/* Slab layer callbacks, slabs are ordinary blocks of the configured strategy */
+static void *slabGrab(void *ctx, size_t size)
+{
+    arena_t *a = ctx;
+    void *ptr;
+
+    lockPool(a);
+    ptr = poolMalloc(a, size);
+    unlockPool(a);
+    return ptr;
+}
+
+static void slabRelease(void *ctx, void *ptr)
+{
+    arena_t *a = ctx;
+
+    lockPool(a);
+    poolFree(a, ptr);
+    unlockPool(a);
+}
+
+/* Like initmem, but with the pool configured by opts (NULL for defaults).
+
+   With opts->headers set, every block's memoryList node is stored in the pool
+   directly in front of the bytes handed out, so myfree finds its block and both
+   neighbours in constant time. The headers take up pool space, which is then
+   reported as allocated.
+
+   With opts->slabs set, requests up to the largest slab size class are
+   rounded up to their class and served from slabs of such objects, which
+   are themselves blocks allocated with the configured strategy.
+
+   With opts->thread_cache set, each thread keeps small blocks it frees for
+   its own next allocations of that size. The queries count those blocks as
+   free only for the thread that cached them.
+
+   With opts->alignment set, every block handed out starts at a multiple of
+   it, a power of two. In-band headers raise it to what their nodes need.
+
+   With opts->reserve larger than sz, the pool starts at sz bytes and grows
+   as needed up to opts->reserve, giving free memory at its end back to the
+   system again. Buddy and Bitmap pools do not grow.
+
+   With opts->huge_pages, opts->populate or opts->numa_nodes set, the pool
+   is backed by 2 MB pages, faulted in up front or kept on those NUMA nodes.
+
+   With opts->remote_free set, the calling thread owns the pool and frees by
+   other threads are queued for it without locking, see arena_drain.
+*/
+void initmem_opts(strategies strategy, size_t sz, const mem_options *opts)
+{
+    arenaInit(&defaultArena, strategy, sz, opts);
+}
+
+/* Set up a, or set it up anew, as a pool of sz bytes. */
+static void arenaInit(arena_t *a, strategies strategy, size_t sz, const mem_options *opts)
+{
+    int i;
+
+    if (!a->locksReady)
+    {
+        initLocks(a);
+    }
+    pthread_once(&keyOnce, createCacheKey);
+    // a new id, so no thread cache takes blocks of the old pool for this one
+    registerArena(a);
+    a->useThreadCache = opts && opts->thread_cache;
+    a->useRemoteFree = opts && opts->remote_free;
+    a->owner = pthread_self();
+    a->remoteFrees = NULL;
+    memset(&a->reallocs, 0, sizeof(a->reallocs));
+    // blocks of the old pool had all their handles, the slots themselves are kept
+    a->freeHandle = -1;
+    for (i = a->handleCount - 1; i >= 0; i--)
+    {
+        a->handles[i].ptr = NULL;
+        a->handles[i].nextFree = a->freeHandle;
+        a->freeHandle = i;
+    }
+    a->compactFrom = NULL;
+
+    a->myStrategy = strategy;
+
+    /* all implementations will need an actual block of memory to use */
+    a->mySize = sz;
+
+    // Release any other memory you were using for bookkeeping when doing a re-initialization!
+
+    // all nodes outside the pool come from the node pool, drop them in one go
+    resetNodePool(a);
+    a->addrTree.node = NULL;
+    a->head = NULL;
+
+    if (a->myMemory != NULL)
+        releasePool(a); /* in case this is not the first time initmem2 is called */
+    bitmap_destroy(&a->bitmapPool);
+    slab_destroy(&a->slabCache);
+
+    a->alignment = (opts && opts->alignment) ? opts->alignment : 1;
+    assert((a->alignment & (a->alignment - 1)) == 0);
+    // in-band headers sit right after the block in front of them, which must end where a node can start
+    if (opts && opts->headers && strategy != Bitmap && a->alignment < _Alignof(struct memoryList))
+    {
+        a->alignment = _Alignof(struct memoryList);
+    }
+
+    // the bitmap keeps no nodes at all, so there is nothing to put in-band
+    a->blockOverhead = (opts && opts->headers && strategy != Bitmap) ? alignUp(sizeof(struct memoryList), a->alignment) : 0;
+    assert(sz > a->blockOverhead);
+
+    reservePool(a, sz, opts);
+    // a growable pool starts with whole pages
+    sz = a->mySize;
+    a->checkMode = opts && opts->check;
+
+    a->useSlabs = opts && opts->slabs;
+    if (a->useSlabs)
+    {
+        slab_init(&a->slabCache, opts->slab_sizes, opts->slab_objects, a->alignment,
+                  a->myMemory, a->reserved ? a->reserved : a->mySize, slabGrab, slabRelease, a);
+    }
+
+    if (strategy == Bitmap)
+    {
+        // granules a multiple of the alignment apart keep every block aligned
+        bitmap_init(&a->bitmapPool, a->myMemory, sz, alignUp(opts && opts->granule ? opts->granule : 1, a->alignment));
+        return;
+    }
+
+    // Initialize memory management structure.
+
+    // init first node of memory, from https://github.com/ArmandasRokas/dtu_notes/wiki/ass3_manual
+    a->head = newNode(a, a->myMemory);
+    a->head->last = a->head;
+    a->head->next = a->head;
+    a->head->size = sz - a->blockOverhead; // initialy the first block spans the whole memory pool.
+    a->head->alloc = 0;                    // not allocated
+    a->next = a->head;                     // only used for next fit
+
+    memset(a->bins, 0, sizeof(a->bins));
+    memset(a->binTrees, 0, sizeof(a->binTrees));
+    a->binMap = 0;
+    a->useBins = (strategy == First || strategy == Buddy);
+    a->binsOrdered = (strategy == First);
+    a->sizeTree.node = NULL;
+    a->useSizeTree = (strategy == Best);
+    a->heapCount = 0;
+    a->freeBytes = 0;
+    a->buddyTail = 0;
+    memset(a->sizeHistogram, 0, sizeof(a->sizeHistogram));
+    // a growable pool may come to have blocks of any size
+    a->sizeCountsLimit = sz < SIZE_TREE_LIMIT && !a->reserved ? sz : SIZE_TREE_LIMIT;
+    free(a->sizeCounts);
+    a->sizeCounts = calloc(a->sizeCountsLimit + 1, sizeof(int));
+
+    if (strategy == Buddy)
+    {
+        buddyInit(a);
+    }
+    else
+    {
+        indexFree(a, a->head);
+    }
+}
+
+/* A new arena of sz bytes managed with the given strategy, independent of
+   the default pool and of every other arena. Configured like initmem_opts.
+*/
+arena_t *arena_create(strategies strategy, size_t sz)
+{
+    return arena_create_opts(strategy, sz, NULL);
+}
+
+arena_t *arena_create_opts(strategies strategy, size_t sz, const mem_options *opts)
+{
+    arena_t *a = calloc(1, sizeof(arena_t));
+
+    arenaInit(a, strategy, sz, opts);
+    return a;
+}
+
+/* Free an arena with everything allocated from it. */
+void arena_destroy(arena_t *a)
+{
+    struct nodeChunk *chunk, *following;
+
+    unregisterArena(a);
+    releasePool(a);
+    bitmap_destroy(&a->bitmapPool);
+    slab_destroy(&a->slabCache);
+    for (chunk = a->chunks; chunk; chunk = following)
+    {
+        following = chunk->next;
+        free(chunk);
+    }
+    free(a->freeHeap);
+    free(a->sizeCounts);
+    free(a->buddyBits);
+    free(a->handles);
+    pthread_mutex_destroy(&a->poolLock);
+    pthread_mutex_destroy(&a->slabLock);
+    free(a);
+}
+
+/* Allocate a block of memory with the requested size.
+ *  If the requested block is not available, mymalloc returns NULL.
+ *  Otherwise, it returns a pointer to the newly allocated block.
+ *  Restriction: requested >= 1
+ */
+
+void *mymalloc(size_t requested)
+{
+    void *ptr = arena_malloc(&defaultArena, requested);
+
+    if (trace_recording())
+    {
+        trace_record_alloc(ptr, requested);
+    }
+    return ptr;
+}
+
+void *arena_malloc(arena_t *a, size_t requested)
+{
+    void *ptr;
+
+    if (tooLarge(a, requested))
+    {
+        return NULL;
+    }
+    requested = alignUp(requested, a->alignment);
+    if (a->useRemoteFree)
+    {
+        // room for the queue link, should the block be freed by another thread
+        requested = requested < sizeof(void *) ? sizeof(void *) : requested;
+        if (pthread_equal(pthread_self(), a->owner) && __atomic_load_n(&a->remoteFrees, __ATOMIC_RELAXED))
+        {
+            drainRemoteFrees(a);
+        }
+    }
+
+    if (a->useThreadCache && (ptr = cachedBlock(a, requested)))
+    {
+        return ptr;
+    }
+
+    if (a->useSlabs)
+    {
+        int cls = slab_class_of(&a->slabCache, requested);
+
+        if (cls >= 0)
+        {
+            pthread_mutex_lock(&a->slabLock);
+            ptr = slab_alloc(&a->slabCache, cls);
+            pthread_mutex_unlock(&a->slabLock);
+            if (ptr)
+            {
+                return ptr;
+            }
+        }
+    }
+
+    return poolAllocate(a, 0, requested);
+}
+
+/* Allocate a block at a multiple of alignment (a power of two) that holds
+ * size bytes. Returns NULL if there is none, or if alignment is no power of
+ * two. With the Buddy strategy and in-band headers, alignments beyond the
+ * pool's alignment cannot be had.
+ */
+void *mymemalign(size_t alignment, size_t size)
+{
+    void *ptr = arena_memalign(&defaultArena, alignment, size);
+
+    // replayed as a plain allocation
+    if (trace_recording())
+    {
+        trace_record_alloc(ptr, size);
+    }
+    return ptr;
+}
+
+void *arena_memalign(arena_t *a, size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) || tooLarge(a, alignment) || tooLarge(a, size))
+    {
+        return NULL;
+    }
+    if (alignment <= a->alignment)
+    {
+        // every block is aligned that much anyway
+        return arena_malloc(a, size);
+    }
+
+    size = alignUp(size, a->alignment);
+    if (a->useRemoteFree)
+    {
+        size = size < sizeof(void *) ? sizeof(void *) : size;
+    }
+    // slabs and cached blocks are only aligned as far as the pool is
+    return poolAllocate(a, alignment, size);
+}
+
+/* One attempt at allocating from the pool itself, alignment 0 for no more than the pool's. */
+static void *poolTry(arena_t *a, size_t alignment, size_t requested)
+{
+    void *ptr;
+
+    lockPool(a);
+    ptr = alignment ? poolMemalign(a, alignment, requested) : poolMalloc(a, requested);
+    unlockPool(a);
+    return ptr;
+}
+
+/* Allocate from the pool itself, giving up memory that is held elsewhere if that is what it takes. */
+static void *poolAllocate(arena_t *a, size_t alignment, size_t requested)
+{
+    void *ptr = poolTry(a, alignment, requested);
+
+    // empty slabs kept around for reuse are the first thing to give up
+    if (!ptr && a->useSlabs)
+    {
+        int trimmed;
+
+        pthread_mutex_lock(&a->slabLock);
+        trimmed = slab_trim(&a->slabCache);
+        pthread_mutex_unlock(&a->slabLock);
+        if (trimmed)
+        {
+            ptr = poolTry(a, alignment, requested);
+        }
+    }
+
+    // then the blocks this thread is holding on to
+    if (!ptr && a->useThreadCache && myCache.arenaId == a->id)
+    {
+        flushCache(&myCache);
+        ptr = poolTry(a, alignment, requested);
+    }
+
+    // and only then more of the reserve
+    while (!ptr)
+    {
+        int grown;
+
+        lockPool(a);
+        grown = growPool(a, requested + alignment);
+        unlockPool(a);
+        if (!grown)
+        {
+            break;
+        }
+        ptr = poolTry(a, alignment, requested);
+    }
+    return ptr;
+}
+
+/* Allocate a block with the configured strategy, bypassing the slabs. */
+static void *poolMalloc(arena_t *a, size_t requested)
+{
+    struct memoryList *memBlock;
+
+    assert((int)a->myStrategy > 0);
+
+    if (a->myStrategy == Bitmap)
+    {
+        void *ptr = bitmap_alloc(&a->bitmapPool, requested);
+        if (a->checkMode && checkPool(a))
+        {
+            abort();
+        }
+        return ptr;
+    }
+
+    memBlock = searchBlock(a, requested);
+
+    // no valid blocks
+    if (!memBlock)
+    {
+        return NULL;
+    }
+    return takeBlock(a, memBlock, requested);
+}
+
+/* The free block the configured strategy picks for the requested size, NULL if none fits. */
+static struct memoryList *searchBlock(arena_t *a, size_t requested)
+{
+    switch (a->myStrategy)
+    {
+    case First:
+        return firstBlock(a, requested);
+    case Best:
+        return bestBlock(a, requested);
+    case Worst:
+        return worstBlock(a, requested);
+    case Next:
+        return nextBlock(a, requested);
+    case Buddy:
+        return buddyBlock(a, requested);
+    default:
+        // no strategy
+        return NULL;
+    }
+}
+
+/* Allocate the front of a block searchBlock found. */
+static void *takeBlock(arena_t *a, struct memoryList *memBlock, size_t requested)
+{
+    if (a->myStrategy == Buddy)
+    {
+        // buddyBlock hands out blocks already split down to size
+    }
+    // only split when the remainder can hold its own header and at least one byte
+    else if (memBlock->size > requested + a->blockOverhead)
+    {
+        unindexFree(a, memBlock);
+        a->next = splitOff(a, memBlock, requested);
+        indexFree(a, a->next);
+    }
+    else
+    {
+        unindexFree(a, memBlock);
+        a->next = memBlock->next;
+    }
+
+    memBlock->alloc = 1;
+    memBlock->handle = 0;
+
+    if (a->checkMode && checkPool(a))
+    {
+        abort();
+    }
+
+    // pointer is returned to block
+    return memBlock->ptr;
+}
+
+/* Bytes to skip at the start of free block node for its bytes to start at a
+ * multiple of alignment, leaving enough of them for a free block.
+ */
+static size_t leadFor(arena_t *a, struct memoryList *node, size_t alignment)
+{
+    size_t lead = (alignment - (uintptr_t)node->ptr % alignment) % alignment;
+
+    // the skipped bytes must hold their own header and at least one byte
+    while (lead > 0 && lead <= a->blockOverhead)
+    {
+        lead += alignment;
+    }
+    return lead;
+}
+
+/* Allocate a block starting at a multiple of alignment, bypassing the slabs. */
+static void *poolMemalign(arena_t *a, size_t alignment, size_t requested)
+{
+    struct memoryList *memBlock, *front;
+    struct rb_node *n;
+    void *ptr = NULL;
+    size_t lead;
+
+    if (a->myStrategy == Bitmap)
+    {
+        ptr = bitmap_alloc_aligned(&a->bitmapPool, requested, alignment);
+    }
+    else if (a->myStrategy == Buddy)
+    {
+        // a buddy block of at least the alignment starts on a multiple of it, its bytes do if the header size is one too
+        if (a->blockOverhead % alignment == 0)
+        {
+            ptr = poolMalloc(a, requested > alignment ? requested : alignment);
+        }
+        if (ptr && (uintptr_t)ptr % alignment)
+        {
+            // larger than the alignment of the pool itself
+            poolFree(a, ptr);
+            ptr = NULL;
+        }
+    }
+    else
+    {
+        // let the strategy choose among the blocks big enough however their bytes are aligned
+        memBlock = searchBlock(a, requested + a->blockOverhead + alignment);
+
+        // and only when none is, look at every free block (in address order)
+        for (n = rb_first(&a->addrTree); !memBlock && n; n = rb_next(n))
+        {
+            struct memoryList *i = rb_entry(n, struct memoryList, addrNode);
+
+            if (!i->alloc && i->size >= leadFor(a, i, alignment) + requested)
+            {
+                memBlock = i;
+            }
+        }
+        if (!memBlock)
+        {
+            return NULL;
+        }
+
+        lead = leadFor(a, memBlock, alignment);
+        if (lead)
+        {
+            // the skipped bytes become a free block of their own
+            front = memBlock;
+            unindexFree(a, front);
+            memBlock = splitOff(a, front, lead - a->blockOverhead);
+            indexFree(a, front);
+            indexFree(a, memBlock);
+        }
+        return takeBlock(a, memBlock, requested);
+    }
+
+    if (a->checkMode && checkPool(a))
+    {
+        abort();
+    }
+    return ptr;
+}
+
+// Find the free block with the smallest address that fits the requested size
+struct memoryList *firstBlock(arena_t *a, size_t requested)
+{
+    int bin = binOf(requested);
+    struct memoryList *found = NULL, *i;
+    unsigned long long above;
+
+    // the requested bin may hold blocks too small, its first fit is the lowest candidate there
+    for (i = a->bins[bin]; i; i = binNext(i))
+    {
+        if (i->size >= requested)
+        {
+            found = i;
+            break;
+        }
+    }
+
+    // every block in a higher bin fits, so each of those bins offers its lowest block
+    for (above = binsAbove(a, bin); above; above &= above - 1)
+    {
+        i = a->bins[__builtin_ctzll(above)];
+        if (!found || i->ptr < found->ptr)
+        {
+            found = i;
+        }
+    }
+
+    return found;
+}
+
+// Find the smallest block larger than the requested size which is not allocated
+struct memoryList *bestBlock(arena_t *a, size_t requested)
+{
+    struct rb_node *n = a->sizeTree.node;
+    struct memoryList *min = NULL;
+
+    // leftmost block of at least the requested size, the lowest address among equal sizes
+    while (n)
+    {
+        struct memoryList *i = rb_entry(n, struct memoryList, sizeNode);
+
+        if (i->size >= requested)
+        {
+            min = i;
+            n = n->left;
+        }
+        else
+        {
+            n = n->right;
+        }
+    }
+
+    return min;
+}
+
+// Find the largest block larger than the requested size which is not allocated
+struct memoryList *worstBlock(arena_t *a, size_t requested)
+{
+    // biggest block sits at the top of the heap, return it if big enough
+    if (a->heapCount > 0 && a->freeHeap[0]->size >= requested)
+    {
+        return a->freeHeap[0];
+    }
+    else
+    {
+        return NULL;
+    }
+}
+
+/* Find the first suitable block after the last block allocated. */
+struct memoryList *nextBlock(arena_t *a, size_t requested)
+{
+    // find next big enough block
+    struct memoryList *start = a->next;
+
+    if (!(a->next->alloc) && a->next->size >= requested)
+    {
+        return a->next;
+    }
+    while ((a->next = a->next->next) != start)
+    {
+        if (!(a->next->alloc) && a->next->size >= requested)
+        {
+            return a->next;
+        }
+    }
+
+    // no block
+    return NULL;
+}
+
+/****** Buddy system ******
+ * The pool is cut into the largest power-of-two blocks that fit, back to
+ * back, so every block of 2^k bytes (header included) starts at a pool
+ * offset that is a multiple of 2^k and its buddy is found by flipping bit k
+ * of that offset. Free blocks of each order sit in the size-class bins.
+ *
+ * For every order there is one bit per buddy pair, holding whether exactly
+ * one of the two is a free block of that order. Flipping it whenever a block
+ * of that order becomes free or stops being free tells myfree whether the
+ * buddy can be merged without looking it up first.
+ */
+
+#define BUDDY_MIN_ORDER 4
+
+static size_t blockSpan(arena_t *a, struct memoryList *node)
+{
+    return a->blockOverhead + node->size;
+}
+
+static size_t poolOffset(arena_t *a, struct memoryList *node)
+{
+    return blockStart(a, node) - (char *)a->myMemory;
+}
+
+/* Flip the pair bit of the order-sized block at offset, returning its new value. */
+static int buddyFlip(arena_t *a, int order, size_t offset)
+{
+    size_t bit = a->buddyBitBase[order] + (offset >> (order + 1));
+
+    a->buddyBits[bit / 8] ^= 1 << (bit % 8);
+    return (a->buddyBits[bit / 8] >> (bit % 8)) & 1;
+}
+
+/* Cut the single free block initmem made into the top-level buddy blocks. */
+static void buddyInit(arena_t *a)
+{
+    struct memoryList *block = a->head;
+    size_t remaining = a->mySize, bits = 0;
+    int order;
+
+    a->buddyMinOrder = BUDDY_MIN_ORDER;
+    while (((size_t)1 << a->buddyMinOrder) <= a->blockOverhead || ((size_t)1 << a->buddyMinOrder) < a->alignment)
+    {
+        a->buddyMinOrder++;
+    }
+    assert(a->mySize >= ((size_t)1 << a->buddyMinOrder));
+
+    for (order = a->buddyMinOrder; order < BIN_COUNT && ((size_t)1 << order) <= a->mySize; order++)
+    {
+        a->buddyBitBase[order] = bits;
+        bits += (a->mySize >> (order + 1)) + 1;
+    }
+    free(a->buddyBits);
+    a->buddyBits = calloc(bits / 8 + 1, 1);
+
+    for (order = binOf(a->mySize); order >= a->buddyMinOrder; order--)
+    {
+        size_t span = (size_t)1 << order;
+
+        if (span > remaining)
+        {
+            continue;
+        }
+        remaining -= span;
+        if (remaining >= ((size_t)1 << a->buddyMinOrder))
+        {
+            splitOff(a, block, span - a->blockOverhead);
+        }
+        else if (remaining > a->blockOverhead)
+        {
+            // the tail is too small for any block, keep it out of use
+            splitOff(a, block, span - a->blockOverhead)->alloc = 1;
+        }
+        else
+        {
+            // not even room for the header of such a block, leave the bytes out of the ring
+            a->buddyTail = remaining;
+            block->size -= remaining;
+        }
+        buddyFlip(a, order, poolOffset(a, block));
+        indexFree(a, block);
+        block = block->next;
+        if (remaining < ((size_t)1 << a->buddyMinOrder))
+        {
+            break;
+        }
+    }
+}
+
+/* Take a free block of the smallest order that fits the requested size and
+ * split it in halves down to that order, freeing every upper half.
+ */
+struct memoryList *buddyBlock(arena_t *a, size_t requested)
+{
+    size_t span = requested + a->blockOverhead;
+    int order = span <= 1 ? 0 : 64 - __builtin_clzll(span - 1);
+    unsigned long long fits;
+    struct memoryList *block;
+
+    if (order < a->buddyMinOrder)
+    {
+        order = a->buddyMinOrder;
+    }
+    if (order >= BIN_COUNT)
+    {
+        return NULL;
+    }
+
+    // bins only hold buddy sizes, and larger orders always land in higher bins
+    fits = a->binMap & (~0ULL << binOf(((size_t)1 << order) - a->blockOverhead));
+    if (!fits)
+    {
+        return NULL;
+    }
+
+    block = a->bins[__builtin_ctzll(fits)];
+    unindexFree(a, block);
+    buddyFlip(a, binOf(blockSpan(a, block)), poolOffset(a, block));
+
+    while (blockSpan(a, block) > ((size_t)1 << order))
+    {
+        size_t half = blockSpan(a, block) / 2;
+        struct memoryList *upper = splitOff(a, block, half - a->blockOverhead);
+
+        buddyFlip(a, binOf(half), poolOffset(a, upper));
+        indexFree(a, upper);
+    }
+
+    return block;
+}
+
+/* Free a buddy block, merging it with its buddy for as long as that is free too. */
+void buddyFree(arena_t *a, struct memoryList *block)
+{
+    int order = binOf(blockSpan(a, block));
+
+    block->alloc = 0;
+
+    // a pair bit dropping to 0 means the buddy is a free block of the same order
+    while (!buddyFlip(a, order, poolOffset(a, block)))
+    {
+        size_t buddyOffset = poolOffset(a, block) ^ ((size_t)1 << order);
+        struct memoryList *buddy = enclosingBlock(a, (char *)a->myMemory + buddyOffset);
+
+        assert(!buddy->alloc && blockSpan(a, buddy) == ((size_t)1 << order));
+        unindexFree(a, buddy);
+        if (buddyOffset < poolOffset(a, block))
+        {
+            block = buddy;
+        }
+        absorbNext(a, block);
+        order++;
+    }
+
+    indexFree(a, block);
+
+    if (a->checkMode && checkPool(a))
+    {
+        abort();
+    }
+}
+
+/* Frees a block of memory previously allocated by mymalloc. */
+void myfree(void *block)
+{
+    // before the block can be handed out again
+    if (trace_recording())
+    {
+        trace_record_free(block);
+    }
+    arena_free(&defaultArena, block);
+}
+
+/* Frees a block of memory previously allocated from a by arena_malloc. */
+void arena_free(arena_t *a, void *block)
+{
+    if (!block)
+    {
+        return;
+    }
+    if (a->useRemoteFree && !pthread_equal(pthread_self(), a->owner))
+    {
+        pushRemoteFree(a, block);
+        return;
+    }
+
+    if (a->useSlabs)
+    {
+        int freed;
+
+        pthread_mutex_lock(&a->slabLock);
+        freed = slab_free(&a->slabCache, block);
+        pthread_mutex_unlock(&a->slabLock);
+        if (freed)
+        {
+            return;
+        }
+    }
+
+    if (a->useThreadCache && cacheBlock(a, block))
+    {
+        return;
+    }
+
+    lockPool(a);
+    poolFree(a, block);
+    unlockPool(a);
+}
+
+/* Free the blocks other threads have freed into a, from any thread. */
+void arena_drain(arena_t *a)
+{
+    drainRemoteFrees(a);
+}
+
+/* Make the calling thread the owner of a, the one that frees blocks directly. */
+void arena_adopt(arena_t *a)
+{
+    a->owner = pthread_self();
+}
+
+/* Give the blocks in the calling thread's cache back to their arena. */
+void mem_thread_flush()
+{
+    if (myCache.arenaId)
+    {
+        flushCache(&myCache);
+    }
+}
+
+/* Free a block of the configured strategy. */
+static void poolFree(arena_t *a, void *block)
+{
+    if (a->myStrategy == Bitmap)
+    {
+        bitmap_free(&a->bitmapPool, block);
+        if (a->checkMode && checkPool(a))
+        {
+            abort();
+        }
+        return;
+    }
+
+    struct memoryList *cont = findBlock(a, block);
+
+    if (!cont || !cont->alloc)
+    {
+        return;
+    }
+    // a free block belongs to no handle, whatever later takes it over
+    cont->handle = 0;
+
+    if (a->myStrategy == Buddy)
+    {
+        buddyFree(a, cont);
+        return;
+    }
+
+    cont->alloc = 0;
+
+    // reduce to a single block if prev is free
+    if (cont != a->head && cont->last->alloc == 0)
+    {
+        struct memoryList *prev = cont->last;
+        unindexFree(a, prev);
+        absorbNext(a, prev);
+        cont = prev;
+    }
+
+    // reduce to single block if next is free
+    if ((cont->next != a->head) && !(cont->next->alloc))
+    {
+        unindexFree(a, cont->next);
+        absorbNext(a, cont);
+    }
+
+    indexFree(a, cont);
+    if (cont->next == a->head)
+    {
+        trimPool(a);
+    }
+
+    if (a->checkMode && checkPool(a))
+    {
+        abort();
+    }
+}
+
+/****** Batches ******
+ * A batch allocation looks for one free block that holds the whole batch,
+ * with a single search, and cuts it up; every block after the first needs
+ * a header of its own there. Only when no free block is that large are the
+ * blocks looked for one by one. Sizes that a slab class covers still come
+ * from the slabs. Buddy and Bitmap blocks cannot be cut from another block,
+ * so there the blocks are always taken one by one.
+ *
+ * A batch free sorts the blocks by address and goes through them in that
+ * order. Each run of blocks that follow each other in the pool is merged,
+ * together with the free blocks on either side of it, into one free block
+ * that is indexed once.
+ *
+ * Batches do not go through the thread caches.
+ */
+
+static int byAddress(const void *x, const void *y)
+{
+    uintptr_t p = (uintptr_t)*(void *const *)x, q = (uintptr_t)*(void *const *)y;
+
+    return (p > q) - (p < q);
+}
+
+/* A request rounded up the way arena_malloc does. */
+static size_t batchSize(arena_t *a, size_t size)
+{
+    size = alignUp(size, a->alignment);
+    return a->useRemoteFree && size < sizeof(void *) ? sizeof(void *) : size;
+}
+
+/* Allocate the blocks of a batch still missing in out from a single free block. Returns 0 if none fits them all. */
+static int carveBatch(arena_t *a, const size_t *sizes, size_t n, void **out)
+{
+    struct memoryList *block, *cur = NULL;
+    size_t k, total = 0, missing = 0, keep = 0;
+
+    for (k = 0; k < n; k++)
+    {
+        if (!out[k])
+        {
+            total += batchSize(a, sizes[k]) + (missing++ ? a->blockOverhead : 0);
+            if (tooLarge(a, total))
+            {
+                return 0;
+            }
+        }
+    }
+    if (missing < 2 || a->myStrategy == Buddy || a->myStrategy == Bitmap)
+    {
+        return 0;
+    }
+
+    lockPool(a);
+    block = searchBlock(a, total);
+    if (block)
+    {
+        takeBlock(a, block, total);
+        for (k = 0; k < n; k++)
+        {
+            if (!out[k])
+            {
+                if (cur)
+                {
+                    // the rest of the span after the previous block
+                    cur = splitOff(a, cur, keep);
+                    cur->alloc = 1;
+                }
+                else
+                {
+                    cur = block;
+                }
+                out[k] = cur->ptr;
+                keep = batchSize(a, sizes[k]);
+            }
+        }
+        if (a->checkMode && checkPool(a))
+        {
+            abort();
+        }
+    }
+    unlockPool(a);
+    return block != NULL;
+}
+
+/* Allocate n blocks of sizes[0] to sizes[n-1] bytes, stored in out.
+ * Returns n, or 0 with out all NULL if not all of them fit.
+ */
+size_t mymalloc_batch(const size_t *sizes, size_t n, void **out)
+{
+    size_t done = arena_malloc_batch(&defaultArena, sizes, n, out), k;
+
+    for (k = 0; k < n && trace_recording(); k++)
+    {
+        trace_record_alloc(out[k], sizes[k]);
+    }
+    return done;
+}
+
+size_t arena_malloc_batch(arena_t *a, const size_t *sizes, size_t n, void **out)
+{
+    size_t k;
+
+    for (k = 0; k < n; k++)
+    {
+        out[k] = NULL;
+        if (tooLarge(a, sizes[k]))
+        {
+            return 0;
+        }
+    }
+    if (a->useRemoteFree && pthread_equal(pthread_self(), a->owner))
+    {
+        drainRemoteFrees(a);
+    }
+
+    if (a->useSlabs)
+    {
+        pthread_mutex_lock(&a->slabLock);
+        for (k = 0; k < n; k++)
+        {
+            int cls = slab_class_of(&a->slabCache, batchSize(a, sizes[k]));
+
+            if (cls >= 0)
+            {
+                out[k] = slab_alloc(&a->slabCache, cls);
+            }
+        }
+        pthread_mutex_unlock(&a->slabLock);
+    }
+
+    if (!carveBatch(a, sizes, n, out))
+    {
+        for (k = 0; k < n; k++)
+        {
+            if (!out[k] && !(out[k] = poolAllocate(a, 0, batchSize(a, sizes[k]))))
+            {
+                // all or nothing
+                arena_free_batch(a, out, n);
+                memset(out, 0, n * sizeof(void *));
+                return 0;
+            }
+        }
+    }
+    return n;
+}
+
+/* Free the pool blocks at the ascending, distinct addresses blocks[0..n-1], with the pool lock held. */
+static void freeSorted(arena_t *a, void **blocks, size_t n)
+{
+    size_t k = 0;
+
+    while (k < n)
+    {
+        struct memoryList *run = findBlock(a, blocks[k++]);
+
+        if (!run || !run->alloc)
+        {
+            continue;
+        }
+        if (a->myStrategy == Buddy)
+        {
+            buddyFree(a, run);
+            continue;
+        }
+
+        run->alloc = 0;
+        if (run != a->head && !run->last->alloc)
+        {
+            struct memoryList *prev = run->last;
+            unindexFree(a, prev);
+            absorbNext(a, prev);
+            run = prev;
+        }
+        // take in the blocks after it that are freed as well, and the free ones among them
+        while (run->next != a->head)
+        {
+            struct memoryList *next = run->next;
+
+            if (!next->alloc)
+            {
+                unindexFree(a, next);
+            }
+            else if (k < n && next->ptr == blocks[k])
+            {
+                k++;
+            }
+            else
+            {
+                break;
+            }
+            absorbNext(a, run);
+        }
+        indexFree(a, run);
+    }
+    trimPool(a);
+
+    if (a->checkMode && checkPool(a))
+    {
+        abort();
+    }
+}
+
+/* Free the n blocks in ptrs, NULL entries skipped. */
+void myfree_batch(void **ptrs, size_t n)
+{
+    size_t k;
+
+    for (k = 0; k < n && trace_recording(); k++)
+    {
+        trace_record_free(ptrs[k]);
+    }
+    arena_free_batch(&defaultArena, ptrs, n);
+}
+
+void arena_free_batch(arena_t *a, void **ptrs, size_t n)
+{
+    void **sorted;
+    size_t k, m = 0, unique = 0;
+
+    if (a->useRemoteFree && !pthread_equal(pthread_self(), a->owner))
+    {
+        for (k = 0; k < n; k++)
+        {
+            if (ptrs[k])
+            {
+                pushRemoteFree(a, ptrs[k]);
+            }
+        }
+        return;
+    }
+
+    sorted = malloc(n * sizeof(void *));
+    if (a->useSlabs)
+    {
+        pthread_mutex_lock(&a->slabLock);
+    }
+    for (k = 0; k < n; k++)
+    {
+        if (ptrs[k] && !(a->useSlabs && slab_free(&a->slabCache, ptrs[k])))
+        {
+            sorted[m++] = ptrs[k];
+        }
+    }
+    if (a->useSlabs)
+    {
+        pthread_mutex_unlock(&a->slabLock);
+    }
+
+    qsort(sorted, m, sizeof(void *), byAddress);
+    for (k = 0; k < m; k++)
+    {
+        // a block freed twice over is freed once
+        if (unique == 0 || sorted[k] != sorted[unique - 1])
+        {
+            sorted[unique++] = sorted[k];
+        }
+    }
+
+    lockPool(a);
+    if (a->myStrategy == Bitmap)
+    {
+        for (k = 0; k < unique; k++)
+        {
+            poolFree(a, sorted[k]);
+        }
+    }
+    else
+    {
+        freeSorted(a, sorted, unique);
+    }
+    unlockPool(a);
+    free(sorted);
+}
+
+/****** Realloc ******
+ * A block is resized where it is whenever possible. Shrinking splits the
+ * surplus off as a free block. Growing takes in the free block after it,
+ * or failing that also the one before it, moving the bytes down. Only when
+ * neither neighbour has room is a new block allocated and the bytes copied.
+ *
+ * Slab objects stay put as long as the new size fits their class, and Buddy
+ * blocks as long as it fits their power of two, halving them where it fits
+ * a smaller one. Bitmap blocks shrink and grow forwards only.
+ */
+
+static void countRealloc(long *counter)
+{
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+/* Give the bytes of an allocated block past its first keep bytes back as a free block. */
+static void releaseTail(arena_t *a, struct memoryList *node, size_t keep)
+{
+    struct memoryList *tail;
+
+    // only split when the remainder can hold its own header and at least one byte
+    if (node->size <= keep + a->blockOverhead)
+    {
+        return;
+    }
+
+    tail = splitOff(a, node, keep);
+    if (tail->next != a->head && !tail->next->alloc)
+    {
+        unindexFree(a, tail->next);
+        absorbNext(a, tail);
+    }
+    indexFree(a, tail);
+}
+
+/* Resize a list strategy block in place or into its neighbours, NULL if they have no room. */
+static void *listResize(arena_t *a, struct memoryList *node, size_t size)
+{
+    struct memoryList *prev = node->last, *after = node->next;
+    size_t nextRoom = (after != a->head && !after->alloc) ? a->blockOverhead + after->size : 0;
+    size_t prevRoom = (node != a->head && !prev->alloc) ? prev->size + a->blockOverhead : 0;
+
+    if (size <= node->size)
+    {
+        releaseTail(a, node, size);
+        countRealloc(&a->reallocs.shrunk);
+        return node->ptr;
+    }
+
+    if (node->size + nextRoom >= size)
+    {
+        unindexFree(a, after);
+        absorbNext(a, node);
+        releaseTail(a, node, size);
+        countRealloc(&a->reallocs.grown);
+        return node->ptr;
+    }
+
+    if (prevRoom && prevRoom + node->size + nextRoom >= size)
+    {
+        void *from = node->ptr;
+        size_t bytes = node->size;
+
+        // merge first, the move may overwrite an in-band header of node
+        unindexFree(a, prev);
+        if (nextRoom)
+        {
+            unindexFree(a, after);
+            absorbNext(a, node);
+        }
+        absorbNext(a, prev);
+        prev->alloc = 1;
+        prev->handle = 0;
+        memmove(prev->ptr, from, bytes);
+        releaseTail(a, prev, size);
+        countRealloc(&a->reallocs.moved);
+        return prev->ptr;
+    }
+
+    return NULL;
+}
+
+/* Shrink a buddy block by halving it for as long as the half still fits. Returns 0 if it is too small. */
+static int buddyResize(arena_t *a, struct memoryList *block, size_t size)
+{
+    size_t span = size + a->blockOverhead;
+
+    if (span > blockSpan(a, block))
+    {
+        return 0;
+    }
+
+    while (blockSpan(a, block) / 2 >= span && blockSpan(a, block) / 2 >= ((size_t)1 << a->buddyMinOrder))
+    {
+        size_t half = blockSpan(a, block) / 2;
+        struct memoryList *upper = splitOff(a, block, half - a->blockOverhead);
+
+        buddyFlip(a, binOf(half), poolOffset(a, upper));
+        indexFree(a, upper);
+    }
+    countRealloc(&a->reallocs.shrunk);
+    return 1;
+}
+
+/* Resize the pool block at ptr without copying it elsewhere, storing its old size.
+ * Returns where the block is now, NULL if it has to be copied (or is no block).
+ */
+static void *poolResize(arena_t *a, void *ptr, size_t size, size_t *old)
+{
+    struct memoryList *node;
+    void *result = NULL;
+
+    *old = 0;
+    if (a->myStrategy == Bitmap)
+    {
+        void *start;
+
+        if (bitmap_block_of(&a->bitmapPool, ptr, &start, old) != 1 || start != ptr)
+        {
+            *old = 0;
+        }
+        else if (bitmap_resize(&a->bitmapPool, ptr, size))
+        {
+            countRealloc(size <= *old ? &a->reallocs.shrunk : &a->reallocs.grown);
+            result = ptr;
+        }
+    }
+    else if ((node = findBlock(a, ptr)) && node->alloc)
+    {
+        *old = node->size;
+        if (a->myStrategy == Buddy)
+        {
+            result = buddyResize(a, node, size) ? ptr : NULL;
+        }
+        else
+        {
+            result = listResize(a, node, size);
+        }
+    }
+
+    if (a->checkMode && checkPool(a))
+    {
+        abort();
+    }
+    return result;
+}
+
+/* Change the size of a block allocated by mymalloc to size bytes, keeping its
+ * contents up to the lesser of the two sizes. Returns the block, which may
+ * have moved, or NULL if there is no room, in which case the block is left
+ * as it was. A NULL block is allocated anew, a size of 0 frees the block.
+ */
+void *myrealloc(void *block, size_t size)
+{
+    uint64_t id;
+    void *ptr;
+
+    // an allocation or a free, and recorded as one
+    if (!block)
+    {
+        return mymalloc(size);
+    }
+    if (size == 0)
+    {
+        myfree(block);
+        return NULL;
+    }
+    // like a free, the old block leaves the recorder before the allocator may hand its address to another thread
+    if (trace_recording() && trace_record_realloc_start(block, &id))
+    {
+        ptr = arena_realloc(&defaultArena, block, size);
+        trace_record_realloc(id, block, ptr, size);
+        return ptr;
+    }
+    return arena_realloc(&defaultArena, block, size);
+}
+
+void *arena_realloc(arena_t *a, void *block, size_t size)
+{
+    size_t old = 0;
+    void *moved;
+
+    if (!block)
+    {
+        return arena_malloc(a, size);
+    }
+    if (size == 0)
+    {
+        arena_free(a, block);
+        return NULL;
+    }
+    if (tooLarge(a, size))
+    {
+        return NULL;
+    }
+    if (a->useRemoteFree && size < sizeof(void *))
+    {
+        size = sizeof(void *);
+    }
+    size = alignUp(size, a->alignment);
+
+    if (a->useSlabs)
+    {
+        pthread_mutex_lock(&a->slabLock);
+        old = slab_object_size(&a->slabCache, block);
+        pthread_mutex_unlock(&a->slabLock);
+        if (old >= size)
+        {
+            countRealloc(&a->reallocs.shrunk);
+            return block;
+        }
+    }
+
+    if (!old)
+    {
+        lockPool(a);
+        moved = poolResize(a, block, size, &old);
+        unlockPool(a);
+        if (moved)
+        {
+            return moved;
+        }
+        if (!old)
+        {
+            // not a block of this arena
+            return NULL;
+        }
+    }
+
+    // last resort, copy the block to a new one
+    moved = arena_malloc(a, size);
+    if (moved)
+    {
+        memcpy(moved, block, old < size ? old : size);
+        arena_free(a, block);
+        countRealloc(&a->reallocs.copied);
+    }
+    return moved;
+}
+
+/* How often realloc took each of its paths since initmem. */
+void mem_realloc_counts(mem_realloc_stats *stats)
+{
+    arena_realloc_counts(&defaultArena, stats);
+}
+
+void arena_realloc_counts(arena_t *a, mem_realloc_stats *stats)
+{
+    stats->shrunk = __atomic_load_n(&a->reallocs.shrunk, __ATOMIC_RELAXED);
+    stats->grown = __atomic_load_n(&a->reallocs.grown, __ATOMIC_RELAXED);
+    stats->moved = __atomic_load_n(&a->reallocs.moved, __ATOMIC_RELAXED);
+    stats->copied = __atomic_load_n(&a->reallocs.copied, __ATOMIC_RELAXED);
+}
+
+/****** Handles and compaction ******
+ * A block allocated through a handle may be moved by mem_compact, which is
+ * why its address is only ever looked up through the handle. Handles are
+ * slots of a per-arena table holding the block's current address; a block
+ * knows its slot, and a pinned one stays where it is.
+ *
+ * Compaction goes up the pool a step at a time. Each step takes the lowest
+ * free block it has not passed yet: if the block after it can be moved, its
+ * bytes are moved down to where the free block starts and the free block
+ * reappears after it, merged with whatever free block follows. Otherwise the
+ * step goes on to the next free block. Where it got to is kept between calls,
+ * so every call can stop after a time budget and the next one carries on.
+ *
+ * Only the list strategies compact. Buddy blocks cannot move without losing
+ * their buddies, and the Bitmap strategy keeps nowhere to note a handle, so
+ * with those handles work but blocks stay put.
+ */
+
+static struct handleSlot *slotOf(arena_t *a, handle_t h)
+{
+    if (h <= 0 || h > a->handleCount || !a->handles[h - 1].ptr)
+    {
+        return NULL;
+    }
+    return &a->handles[h - 1];
+}
+
+/* Allocate a block that compaction may move, addressed by the handle returned, 0 if there is no room. */
+handle_t myhalloc(size_t size)
+{
+    return arena_halloc(&defaultArena, size);
 }
 
-/* Allocate a block of memory with the requested size.
- *  If the requested block is not available, mymalloc returns NULL.
- *  Otherwise, it returns a pointer to the newly allocated block.
- *  Restriction: requested >= 1
- */
-
-void *mymalloc(size_t requested)
+handle_t arena_halloc(arena_t *a, size_t size)
 {
-    assert((int)myStrategy > 0);
+    struct handleSlot *slot;
+    handle_t h;
+    void *ptr;
 
-    struct memoryList *memBlock = NULL;
-    switch (myStrategy)
+    if (tooLarge(a, size))
     {
-    case First:
-        memBlock = firstBlock(requested);
-        break;
-    case Best:
-        memBlock = bestBlock(requested);
-        break;
-    case Worst:
-        memBlock = worstBlock(requested);
-        break;
-    case Next:
-        memBlock = nextBlock(requested);
-        break;
-    default:
-        // no strategy
-        return NULL;
+        return 0;
     }
-
-    // no valid blocks
-    if (!memBlock)
+    size = alignUp(size, a->alignment);
+    // straight from the pool, slab objects and cached blocks cannot be told to move
+    ptr = poolAllocate(a, 0, size);
+    if (!ptr)
     {
-        return NULL;
+        return 0;
     }
 
-    if (memBlock->size > requested)
+    lockPool(a);
+    if (a->freeHandle < 0)
     {
-        struct memoryList *remainder = malloc(sizeof(struct memoryList));
-
-        // insert remainder into the memory
-        remainder->next = memBlock->next;
-        // remainder->next->last = remainder;
-        remainder->last = memBlock;
-        memBlock->next = remainder;
-
-        // divide memory
-        remainder->size = memBlock->size - requested;
-        remainder->alloc = 0;
-        // TODO illegal pointer arithmetic?
-        remainder->ptr = memBlock->ptr + requested;
-        memBlock->size = requested;
-        next = remainder;
+        a->handles = realloc(a->handles, (a->handleCount + 1) * sizeof(struct handleSlot));
+        a->handles[a->handleCount].nextFree = -1;
+        a->freeHandle = a->handleCount++;
     }
-    else
+    h = a->freeHandle + 1;
+    slot = &a->handles[a->freeHandle];
+    a->freeHandle = slot->nextFree;
+    slot->ptr = ptr;
+    slot->pins = 0;
+    if (a->myStrategy != Bitmap && a->myStrategy != Buddy)
     {
-        next = memBlock->next;
+        findBlock(a, ptr)->handle = h;
     }
+    unlockPool(a);
+    return h;
+}
 
-    memBlock->alloc = 1;
+/* Current address of the block of handle h, only valid until the next mem_compact unless pinned. */
+void *hderef(handle_t h)
+{
+    return arena_hderef(&defaultArena, h);
+}
 
-    // pointer is returned to block
-    return memBlock->ptr;
+void *arena_hderef(arena_t *a, handle_t h)
+{
+    struct handleSlot *slot;
+    void *ptr;
+
+    lockPool(a);
+    slot = slotOf(a, h);
+    ptr = slot ? slot->ptr : NULL;
+    unlockPool(a);
+    return ptr;
 }
 
-// Find the first block of memory larger than the requested size which is available
-struct memoryList *firstBlock(size_t requested)
+/* Keep the block of h where it is until a matching hunpin, returning its address. */
+void *hpin(handle_t h)
 {
-    // find block
-    struct memoryList *i = head;
+    return arena_hpin(&defaultArena, h);
+}
 
-    if (!(i->alloc) && i->size >= requested)
-    {
-        return i;
-    }
-    while ((i = i->next) != head)
+void *arena_hpin(arena_t *a, handle_t h)
+{
+    struct handleSlot *slot;
+    void *ptr = NULL;
+
+    lockPool(a);
+    if ((slot = slotOf(a, h)))
     {
-        if (!(i->alloc) && i->size >= requested)
-        {
-            return i;
-        }
+        slot->pins++;
+        ptr = slot->ptr;
     }
+    unlockPool(a);
+    return ptr;
+}
 
-    // no block
-    return NULL;
+void hunpin(handle_t h)
+{
+    arena_hunpin(&defaultArena, h);
 }
 
-// Find the smallest block larger than the requested size which is not allocated
-struct memoryList *bestBlock(size_t requested)
+void arena_hunpin(arena_t *a, handle_t h)
 {
-    // find most optimally sized block
-    struct memoryList *i = head, *min = NULL;
+    struct handleSlot *slot;
 
-    if (!(i->alloc) && (i->size >= requested) && (!min || i->size < min->size))
-    {
-        min = i;
-    }
-    while ((i = i->next) != head)
+    lockPool(a);
+    if ((slot = slotOf(a, h)) && slot->pins > 0)
     {
-        if (!(i->alloc) && (i->size >= requested) && (!min || i->size < min->size))
-        {
-            min = i;
-        }
+        slot->pins--;
     }
-
-    return min;
+    unlockPool(a);
 }
 
-// Find the largest block larger than the requested size which is not allocated
-struct memoryList *worstBlock(size_t requested)
+/* Free the block of handle h, and the handle with it. */
+void hfree(handle_t h)
 {
-    // find biggest block
-    struct memoryList *index = head, *max = NULL;
+    arena_hfree(&defaultArena, h);
+}
 
-    if (!(index->alloc) && (!max || index->size > max->size))
-    {
-        max = index;
-    }
-    while ((index = index->next) != head)
-    {
-        if (!(index->alloc) && (!max || index->size > max->size))
-        {
-            max = index;
-        }
-    }
+void arena_hfree(arena_t *a, handle_t h)
+{
+    struct handleSlot *slot;
 
-    // return found block if big enough
-    if (max->size >= requested)
-    {
-        return max;
-    }
-    else
+    lockPool(a);
+    if ((slot = slotOf(a, h)))
     {
-        return NULL;
+        poolFree(a, slot->ptr);
+        slot->ptr = NULL;
+        slot->nextFree = a->freeHandle;
+        a->freeHandle = h - 1;
     }
+    unlockPool(a);
 }
 
-/* Find the first suitable block after the last block allocated. */
-struct memoryList *nextBlock(size_t requested)
+static int movable(arena_t *a, struct memoryList *node)
 {
-    // find next big enough block
-    struct memoryList *start = next;
+    return node->alloc && node->handle && a->handles[node->handle - 1].pins == 0;
+}
 
-    if (!(next->alloc) && next->size >= requested)
-    {
-        return next;
-    }
-    while ((next = next->next) != start)
+/* Move the allocated block after free block hole down into it. Returns the free block that ends up after it. */
+static struct memoryList *slideDown(arena_t *a, struct memoryList *hole)
+{
+    struct memoryList *block = hole->next, *after;
+    void *from = block->ptr;
+    size_t size = block->size;
+    handle_t h = block->handle;
+
+    // make the two one block first, the move overwrites the header of an in-band node
+    unindexFree(a, hole);
+    absorbNext(a, hole);
+    memmove(hole->ptr, from, size);
+
+    after = splitOff(a, hole, size);
+    hole->alloc = 1;
+    hole->handle = h;
+    a->handles[h - 1].ptr = hole->ptr;
+
+    if (after->next != a->head && !after->next->alloc)
     {
-        if (!(next->alloc) && next->size >= requested)
-        {
-            return next;
-        }
+        unindexFree(a, after->next);
+        absorbNext(a, after);
     }
+    indexFree(a, after);
+    return after;
+}
 
-    // no block
-    return NULL;
+/* Move blocks allocated through handles together for up to budget
+ * microseconds, merging the free space between them. Returns 1 once the
+ * pool is as compact as the pinned and other blocks allow, 0 if the budget
+ * ran out first; the next call carries on from there.
+ */
+int mem_compact(long budget)
+{
+    return arena_compact(&defaultArena, budget);
 }
 
-/* Frees a block of memory previously allocated by mymalloc. */
-void myfree(void *block)
+int arena_compact(arena_t *a, long budget)
 {
-    // iterate over memory, find target block container
-    struct memoryList *cont = head;
+    struct timespec start, now;
+    struct memoryList *i;
+    int done = 0;
 
-    while ((cont = cont->next) != head)
+    if (a->myStrategy == Bitmap || a->myStrategy == Buddy)
     {
-        if (cont->ptr == block)
-        {
-            break;
-        }
+        return 1;
     }
 
-    cont->alloc = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    lockPool(a);
 
-    // reduce to a single block if prev is free
-    if (cont != head && cont->last->alloc == 0)
+    // the first free block from where the last call stopped
+    i = a->compactFrom ? enclosingBlock(a, a->compactFrom) : a->head;
+    while (i->alloc && i->next != a->head)
     {
-        struct memoryList *prev = cont->last;
-        prev->next = cont->next;
-        prev->next->last = prev;
-        prev->size += cont->size;
+        i = i->next;
+    }
 
-        if (next == cont)
+    while (!done)
+    {
+        if (i->alloc || i->next == a->head)
+        {
+            // passed the last free block
+            done = 1;
+            break;
+        }
+        if (movable(a, i->next))
+        {
+            i = slideDown(a, i);
+        }
+        else
         {
-            next = prev;
+            // step over the blocks that stay, to the next free one
+            do
+            {
+                i = i->next;
+            } while (i->alloc && i->next != a->head);
         }
 
-        free(cont);
-        cont = prev;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000 >= budget)
+        {
+            break;
+        }
     }
 
-    // reduce to single block if next is free
-    if ((cont->next != head) && !(cont->next->alloc))
+    a->compactFrom = done ? NULL : blockStart(a, i);
+    if (a->checkMode && checkPool(a))
     {
-        struct memoryList *latter = cont->next;
-        cont->next = latter->next;
-        cont->next->last = cont;
-        cont->size += latter->size;
+        abort();
+    }
+    unlockPool(a);
+    return done;
+}
 
-        if (next == latter)
-        {
-            next = cont;
-        }
+/****** Tracing ******
+ * The calls on the default pool, mymalloc and myfree and their relatives,
+ * can be recorded to a trace file, see trace.h, and replayed with
+ * "mem -replay".
+ */
 
-        free(latter);
-    }
+/* Record every call on the default pool to a new trace at path, until
+ * mem_trace_stop. Returns 0, or -1 if the file cannot be written.
+ */
+int mem_trace_start(const char *path)
+{
+    return trace_record_start(path, defaultArena.mySize, defaultArena.myStrategy);
+}
+
+void mem_trace_stop()
+{
+    trace_record_stop();
 }
 
 /****** Memory status/property functions ******
@@ -306,102 +2981,346 @@ void myfree(void *block)
 /* Get the number of contiguous areas of free space in memory. */
 int mem_holes()
 {
-    int holes = mem_small_free(mySize + 1);
+    return arena_holes(&defaultArena);
+}
+
+/* mem_holes with the pool lock already held */
+static int poolHoles(arena_t *a)
+{
+    if (a->myStrategy == Bitmap)
+    {
+        return bitmap_holes(&a->bitmapPool);
+    }
+    // every free block is in the heap exactly once
+    return a->heapCount;
+}
+
+int arena_holes(arena_t *a)
+{
+    int holes;
+
+    flushOwnCache(a);
+    lockPool(a);
+    holes = poolHoles(a);
+    unlockPool(a);
     return holes;
 }
 
 /* Get the number of bytes allocated */
-int mem_allocated()
+size_t mem_allocated()
 {
-    int allocated = mySize - mem_free();
-    return allocated;
+    return arena_allocated(&defaultArena);
+}
+
+size_t arena_allocated(arena_t *a)
+{
+    return a->mySize - arena_free_bytes(a);
 }
 
 /* Number of non-allocated bytes */
-int mem_free()
+size_t mem_free()
 {
-    int count = 0;
+    return arena_free_bytes(&defaultArena);
+}
+
+size_t arena_free_bytes(arena_t *a)
+{
+    size_t count;
+
+    flushOwnCache(a);
+    lockPool(a);
+    count = a->myStrategy == Bitmap ? bitmap_free_bytes(&a->bitmapPool) : a->freeBytes;
+    unlockPool(a);
+    return count;
+}
+
+/* Number of bytes in the largest contiguous area of unallocated memory */
+size_t mem_largest_free()
+{
+    return arena_largest_free(&defaultArena);
+}
+
+/* mem_largest_free with the pool lock already held */
+static size_t poolLargestFree(arena_t *a)
+{
+    if (a->myStrategy == Bitmap)
+    {
+        return bitmap_largest_free(&a->bitmapPool);
+    }
+    return a->heapCount > 0 ? a->freeHeap[0]->size : 0;
+}
+
+size_t arena_largest_free(arena_t *a)
+{
+    size_t maxSize;
 
-    // loop over memory
-    struct memoryList *i = head;
+    flushOwnCache(a);
+    lockPool(a);
+    maxSize = poolLargestFree(a);
+    unlockPool(a);
+    return maxSize;
+}
 
-    // sum if block isn't allocated
-    if (i->alloc == 0)
+/* Number of free blocks in the heap subtree at index larger than size bytes.
+ * Subtrees whose root is not larger are skipped whole, so this only visits
+ * the blocks it counts (and their direct children).
+ */
+static int countHeapAbove(arena_t *a, int index, size_t size)
+{
+    if (index >= a->heapCount || a->freeHeap[index]->size <= size)
     {
-        count += i->size;
+        return 0;
     }
-    while ((i = i->next) != head)
+    return 1 + countHeapAbove(a, 2 * index + 1, size) + countHeapAbove(a, 2 * index + 2, size);
+}
+
+/* Number of free blocks smaller than "size" bytes. */
+int mem_small_free(size_t size)
+{
+    return arena_small_free(&defaultArena, size);
+}
+
+int arena_small_free(arena_t *a, size_t size)
+{
+    int count;
+
+    if (size == 0)
     {
-        if (i->alloc == 0)
-        {
-            count += i->size;
-        }
+        return 0;
     }
 
+    flushOwnCache(a);
+    lockPool(a);
+    if (a->myStrategy == Bitmap)
+    {
+        count = bitmap_small_free(&a->bitmapPool, size);
+    }
+    else if (size <= a->sizeCountsLimit)
+    {
+        count = countSizesUpTo(a, size);
+    }
+    else
+    {
+        // few blocks can be larger than a threshold this big, count those instead
+        count = a->heapCount - countHeapAbove(a, 0, size);
+    }
+    unlockPool(a);
     return count;
 }
 
-/* Number of bytes in the largest contiguous area of unallocated memory */
-int mem_largest_free()
+/* Fill counts[k] with the number of free blocks of 2^k to 2^(k+1)-1 bytes, for k < n.
+ * Returns the number of size classes needed to hold every free block.
+ */
+int mem_free_histogram(int *counts, int n)
 {
-    int maxSize = 0;
+    return arena_free_histogram(&defaultArena, counts, n);
+}
 
-    struct memoryList *i = head;
+int arena_free_histogram(arena_t *a, int *counts, int n)
+{
+    int k, used = 0;
 
-    // find bigger maxSize if not allocated and actually greater
-    if ((i->alloc == 0) && (i->size > maxSize))
+    flushOwnCache(a);
+    lockPool(a);
+    if (a->myStrategy == Bitmap)
     {
-        maxSize = i->size;
+        used = bitmap_histogram(&a->bitmapPool, counts, n);
     }
-    while ((i = i->next) != head)
+    else
     {
-        if ((i->alloc == 0) && (i->size > maxSize))
+        for (k = 0; k < BIN_COUNT; k++)
         {
-            maxSize = i->size;
+            if (k < n)
+            {
+                counts[k] = a->sizeHistogram[k];
+            }
+            if (a->sizeHistogram[k])
+            {
+                used = k + 1;
+            }
         }
     }
+    unlockPool(a);
+    return used;
+}
 
-    return maxSize;
+char mem_is_alloc(void *ptr)
+{
+    return arena_is_alloc(&defaultArena, ptr);
 }
 
-/* Number of free blocks smaller than "size" bytes. */
-int mem_small_free(int size)
+char arena_is_alloc(arena_t *a, void *ptr)
 {
-    int count = 0;
+    char alloc;
+
+    flushOwnCache(a);
+    lockPool(a);
+    if (a->myStrategy == Bitmap)
+    {
+        alloc = bitmap_block_of(&a->bitmapPool, ptr, NULL, NULL) == 1;
+    }
+    else
+    {
+        alloc = enclosingBlock(a, ptr)->alloc;
+    }
+    unlockPool(a);
+    return alloc;
+}
+
+/* Find the block containing ptr, storing where its bytes start and how many there are.
+ * Returns 1 if the block is allocated, 0 if it is free and -1 if ptr is outside the pool.
+ */
+int mem_block_of(void *ptr, void **start, size_t *size)
+{
+    return arena_block_of(&defaultArena, ptr, start, size);
+}
 
-    struct memoryList *i = head;
+int arena_block_of(arena_t *a, void *ptr, void **start, size_t *size)
+{
+    struct memoryList *i;
+    size_t bytes = 0;
+    int alloc;
 
-    // sum if this block is smaller
-    if (i->size <= size)
+    flushOwnCache(a);
+    lockPool(a);
+    if (a->myStrategy == Bitmap)
+    {
+        alloc = bitmap_block_of(&a->bitmapPool, ptr, start, &bytes);
+    }
+    else if ((char *)ptr < (char *)a->myMemory || (char *)ptr >= (char *)a->myMemory + a->mySize)
     {
-        count += !(i->alloc);
+        alloc = -1;
     }
-    while ((i = i->next) != head)
+    else
     {
-        if (i->size <= size)
+        i = enclosingBlock(a, ptr);
+        if (start)
         {
-            count += !(i->alloc);
+            *start = i->ptr;
         }
+        bytes = i->size;
+        alloc = i->alloc;
     }
+    unlockPool(a);
 
-    return count;
+    if (size && alloc >= 0)
+    {
+        *size = bytes;
+    }
+    return alloc;
 }
 
-char mem_is_alloc(void *ptr)
+/* Walk the whole pool and verify the running counters and indexes against it.
+ * Returns 0 if everything agrees, otherwise prints what does not and returns 1.
+ */
+int mem_check()
+{
+    return arena_check(&defaultArena);
+}
+
+int arena_check(arena_t *a)
+{
+    int errors;
+
+    flushOwnCache(a);
+    lockPool(a);
+    errors = checkPool(a);
+    unlockPool(a);
+    return errors;
+}
+
+/* mem_check with the pool lock already held */
+static int checkPool(arena_t *a)
 {
-    struct memoryList *i = head;
-    while (i->next != head)
+    size_t walkedFree = 0, walkedSpan = 0;
+    size_t walkedLargest = 0;
+    int walkedHoles = 0, walkedCounted = 0, errors = 0;
+    struct memoryList *i = a->head;
+    struct rb_node *n = rb_first(&a->addrTree);
+
+    if (a->myStrategy == Bitmap)
+    {
+        return bitmap_check(&a->bitmapPool);
+    }
+
+    do
     {
-        // if the next block pointer is append target, this is the target block
-        if (ptr < i->next->ptr)
+        if (!n || rb_entry(n, struct memoryList, addrNode) != i)
         {
-            return i->alloc;
+            printf("mem_check: address index out of step at block %p\n", i->ptr);
+            errors++;
         }
-        i = i->next;
+        n = n ? rb_next(n) : NULL;
+        walkedSpan += a->blockOverhead + i->size;
+        if (i->next->last != i)
+        {
+            printf("mem_check: broken back link after block at %p\n", i->ptr);
+            errors++;
+        }
+        if (i->next != a->head && blockStart(a, i->next) != (char *)i->ptr + i->size)
+        {
+            printf("mem_check: block at %p does not end where the next one starts\n", i->ptr);
+            errors++;
+        }
+        if (i->alloc && i->handle && (i->handle > a->handleCount || a->handles[i->handle - 1].ptr != i->ptr))
+        {
+            printf("mem_check: handle %d does not lead to its block at %p\n", i->handle, i->ptr);
+            errors++;
+        }
+        if (!i->alloc)
+        {
+            walkedFree += i->size;
+            walkedHoles++;
+            walkedCounted += i->size <= a->sizeCountsLimit;
+            if (i->size > walkedLargest)
+            {
+                walkedLargest = i->size;
+            }
+            if (i->next != a->head && !i->next->alloc && a->myStrategy != Buddy)
+            {
+                printf("mem_check: adjacent free blocks at %p\n", i->ptr);
+                errors++;
+            }
+            if (i->heapIndex >= a->heapCount || a->freeHeap[i->heapIndex] != i)
+            {
+                printf("mem_check: free block at %p missing from the heap\n", i->ptr);
+                errors++;
+            }
+        }
+    } while ((i = i->next) != a->head);
+
+    if (n)
+    {
+        printf("mem_check: address index holds blocks that are not in the pool\n");
+        errors++;
+    }
+    if (walkedSpan + a->buddyTail != a->mySize)
+    {
+        printf("mem_check: blocks cover %zu bytes, pool has %zu\n", walkedSpan, a->mySize);
+        errors++;
+    }
+    if (walkedFree != a->freeBytes)
+    {
+        printf("mem_check: %zu bytes free, counter says %zu\n", walkedFree, a->freeBytes);
+        errors++;
+    }
+    if (walkedHoles != poolHoles(a))
+    {
+        printf("mem_check: %d holes, counter says %d\n", walkedHoles, poolHoles(a));
+        errors++;
+    }
+    if (walkedCounted != countSizesUpTo(a, a->sizeCountsLimit))
+    {
+        printf("mem_check: size counts hold %d blocks, expected %d\n", countSizesUpTo(a, a->sizeCountsLimit), walkedCounted);
+        errors++;
+    }
+    if (walkedLargest != poolLargestFree(a))
+    {
+        printf("mem_check: largest free block is %zu, heap says %zu\n", walkedLargest, poolLargestFree(a));
+        errors++;
     }
 
-    // we are at the last block therefore target is here
-    return i->alloc;
+    return errors > 0;
 }
 
 /*
@@ -412,13 +3331,34 @@ char mem_is_alloc(void *ptr)
 // Returns a pointer to the memory pool.
 void *mem_pool()
 {
-    return myMemory;
+    return arena_pool(&defaultArena);
+}
+
+void *arena_pool(arena_t *a)
+{
+    return a->myMemory;
+}
+
+// Returns the total number of bytes in the memory pool, as far as it has grown. */
+size_t mem_total()
+{
+    return arena_total(&defaultArena);
+}
+
+size_t arena_total(arena_t *a)
+{
+    return a->mySize;
 }
 
-// Returns the total number of bytes in the memory pool. */
-int mem_total()
+/* Returns the number of bytes the pool may grow to, mem_total for a pool that does not grow. */
+size_t mem_reserved()
 {
-    return mySize;
+    return arena_reserved(&defaultArena);
+}
+
+size_t arena_reserved(arena_t *a)
+{
+    return a->reserved ? a->reserved : a->mySize;
 }
 
 // Get string name for a strategy.
@@ -434,6 +3374,10 @@ char *strategy_name(strategies strategy)
         return "first";
     case Next:
         return "next";
+    case Buddy:
+        return "buddy";
+    case Bitmap:
+        return "bitmap";
     default:
         return "unknown";
     }
@@ -458,6 +3402,14 @@ strategies strategyFromString(char *strategy)
     {
         return Next;
     }
+    else if (!strcmp(strategy, "buddy"))
+    {
+        return Buddy;
+    }
+    else if (!strcmp(strategy, "bitmap"))
+    {
+        return Bitmap;
+    }
     else
     {
         return 0;
@@ -472,15 +3424,29 @@ strategies strategyFromString(char *strategy)
 /* Use this function to print out the current contents of memory. */
 void print_memory()
 {
-    printf("Current memory: \n");
-    /* Iterate over memory list */
-    struct memoryList *i = head;
+    arena_print(&defaultArena);
+}
 
-    printf("\t%p,\tsize: %d,\t%s\n", i->ptr, i->size, (i->alloc ? "[allocd]" : "[free]"));
-    while ((i = i->next) != head)
+void arena_print(arena_t *a)
+{
+    printf("Current memory: \n");
+    lockPool(a);
+    if (a->myStrategy == Bitmap)
+    {
+        bitmap_print(&a->bitmapPool);
+    }
+    else
     {
-        printf("\t%p,\tsize: %d,\t%s\n", i->ptr, i->size, (i->alloc ? "[allocd]" : "[free]"));
+        /* Iterate over memory list */
+        struct memoryList *i = a->head;
+
+        printf("\t%p,\tsize: %zu,\t%s\n", i->ptr, i->size, (i->alloc ? "[allocd]" : "[free]"));
+        while ((i = i->next) != a->head)
+        {
+            printf("\t%p,\tsize: %zu,\t%s\n", i->ptr, i->size, (i->alloc ? "[allocd]" : "[free]"));
+        }
     }
+    unlockPool(a);
     printf("\n");
 }
 
@@ -490,9 +3456,24 @@ void print_memory()
  */
 void print_memory_status()
 {
-    printf("%d out of %d bytes allocated.\n", mem_allocated(), mem_total());
-    printf("%d bytes are free in %d holes; maximum allocatable block is %d bytes.\n", mem_free(), mem_holes(), mem_largest_free());
-    printf("Average hole size is %f.\n\n", ((float)mem_free()) / mem_holes());
+    arena_print_status(&defaultArena);
+}
+
+void arena_print_status(arena_t *a)
+{
+    printf("%zu out of %zu bytes allocated.\n", arena_allocated(a), arena_total(a));
+    if (a->reserved)
+    {
+        printf("The pool may grow to %zu bytes.\n", a->reserved);
+    }
+    if (a->useSlabs)
+    {
+        pthread_mutex_lock(&a->slabLock);
+        slab_print(&a->slabCache);
+        pthread_mutex_unlock(&a->slabLock);
+    }
+    printf("%zu bytes are free in %d holes; maximum allocatable block is %zu bytes.\n", arena_free_bytes(a), arena_holes(a), arena_largest_free(a));
+    printf("Average hole size is %f.\n\n", ((float)arena_free_bytes(a)) / arena_holes(a));
 }
 
 /* Use this function to see what happens when your malloc and free
@@ -6,25 +6,123 @@ typedef enum strategies_enum
 	Best = 1,
 	Worst = 2,
 	First = 3,
-	Next = 4
+	Next = 4,
+	Buddy = 5,
+	Bitmap = 6
 } strategies;
 
+/* Highest strategy value, for loops over every strategy */
+#define LastStrategy Bitmap
+
 char *strategy_name(strategies strategy);
 strategies strategyFromString(char * strategy);
 
 
+/* Optional pool configuration, passed to initmem_opts().
+ * A zeroed struct gives the same behaviour as plain initmem().
+ */
+typedef struct mem_options
+{
+	int headers; /* 1 to keep each block's bookkeeping in-band, in front of the block */
+	int check;   /* 1 to run mem_check after every mymalloc and myfree, aborting on errors */
+	size_t granule; /* bytes per bit with the Bitmap strategy, 0 for 1 */
+	int slabs;      /* 1 to serve small requests from slabs of fixed-size objects */
+	const size_t *slab_sizes; /* ascending size classes ending in 0, NULL for 16 to 512 bytes */
+	int slab_objects;         /* objects per slab, 0 to size slabs by class */
+	int thread_cache; /* 1 to keep freed small blocks in per-thread caches */
+	int remote_free;  /* 1 to queue frees by threads other than the owner for the owner to do */
+	size_t alignment; /* power of two every block starts at a multiple of, 0 for 1, or what headers need */
+	size_t reserve;   /* bytes the pool may grow to, 0 for a pool of fixed size; not for Buddy and Bitmap */
+	int huge_pages;   /* 1 to back the pool with 2 MB pages where the system allows */
+	int populate;     /* 1 to fault every page of the pool in up front */
+	unsigned long numa_nodes; /* mask of the NUMA nodes to keep the pool on, 0 for any */
+} mem_options;
+
+/* Independent pools. initmem, mymalloc, myfree and the mem_* queries below
+ * work on a default arena, these on any other.
+ */
+typedef struct arena arena_t;
+
+/* How often myrealloc took each of its paths, see mem_realloc_counts(). */
+typedef struct mem_realloc_stats
+{
+	long shrunk; /* kept in place without taking more of the pool */
+	long grown;  /* grown in place into the free block after it */
+	long moved;  /* grown into the free block before it, moving the bytes down */
+	long copied; /* copied to a new block, the last resort */
+} mem_realloc_stats;
+
+/* Blocks that mem_compact may move, addressed through a handle instead of a
+ * pointer. 0 is never a handle.
+ */
+typedef int handle_t;
+
 void initmem(strategies strategy, size_t sz);
+void initmem_opts(strategies strategy, size_t sz, const mem_options *opts);
 void *mymalloc(size_t requested);
 void myfree(void* block);
+size_t mymalloc_batch(const size_t *sizes, size_t n, void **out);
+void myfree_batch(void **ptrs, size_t n);
+void *myrealloc(void *block, size_t size);
+void *mymemalign(size_t alignment, size_t size);
+void mem_thread_flush();
+int mem_trace_start(const char *path);
+void mem_trace_stop();
+
+handle_t myhalloc(size_t size);
+void *hderef(handle_t h);
+void *hpin(handle_t h);
+void hunpin(handle_t h);
+void hfree(handle_t h);
+int mem_compact(long budget); /* budget in microseconds, returns 1 once done */
 
 int mem_holes();
-int mem_allocated();
-int mem_free();
-int mem_total();
-int mem_largest_free();
-int mem_small_free(int size);
+size_t mem_allocated();
+size_t mem_free();
+size_t mem_total();
+size_t mem_reserved();
+size_t mem_largest_free();
+int mem_small_free(size_t size);
+int mem_free_histogram(int *counts, int n);
 char mem_is_alloc(void *ptr);
+int mem_block_of(void *ptr, void **start, size_t *size);
+int mem_check();
+void mem_realloc_counts(mem_realloc_stats *stats);
 void* mem_pool();
 void print_memory();
 void print_memory_status();
 void try_mymem(int argc, char **argv);
+
+arena_t *arena_create(strategies strategy, size_t sz);
+arena_t *arena_create_opts(strategies strategy, size_t sz, const mem_options *opts);
+void arena_destroy(arena_t *a);
+void *arena_malloc(arena_t *a, size_t requested);
+void arena_free(arena_t *a, void *block);
+size_t arena_malloc_batch(arena_t *a, const size_t *sizes, size_t n, void **out);
+void arena_free_batch(arena_t *a, void **ptrs, size_t n);
+void *arena_realloc(arena_t *a, void *block, size_t size);
+void *arena_memalign(arena_t *a, size_t alignment, size_t size);
+void arena_realloc_counts(arena_t *a, mem_realloc_stats *stats);
+void arena_drain(arena_t *a);
+void arena_adopt(arena_t *a);
+handle_t arena_halloc(arena_t *a, size_t size);
+void *arena_hderef(arena_t *a, handle_t h);
+void *arena_hpin(arena_t *a, handle_t h);
+void arena_hunpin(arena_t *a, handle_t h);
+void arena_hfree(arena_t *a, handle_t h);
+int arena_compact(arena_t *a, long budget);
+
+int arena_holes(arena_t *a);
+size_t arena_allocated(arena_t *a);
+size_t arena_free_bytes(arena_t *a); /* mem_free, arena_free being taken by the block free */
+size_t arena_total(arena_t *a);
+size_t arena_reserved(arena_t *a);
+size_t arena_largest_free(arena_t *a);
+int arena_small_free(arena_t *a, size_t size);
+int arena_free_histogram(arena_t *a, int *counts, int n);
+char arena_is_alloc(arena_t *a, void *ptr);
+int arena_block_of(arena_t *a, void *ptr, void **start, size_t *size);
+int arena_check(arena_t *a);
+void *arena_pool(arena_t *a);
+void arena_print(arena_t *a);
+void arena_print_status(arena_t *a);
@@ -0,0 +1,284 @@
+/*
+An intrusive red-black tree, see rbtree.h.
+Follows the textbook algorithm with NULL leaves standing in for black nil nodes.
+*/
+#include <stddef.h>
+
+#include "rbtree.h"
+
+/* Point whatever referred to old (its parent or the root) at new instead. */
+static void replace_child(struct rb_root *root, struct rb_node *old, struct rb_node *new)
+{
+	struct rb_node *parent = old->parent;
+
+	if (!parent)
+		root->node = new;
+	else if (parent->left == old)
+		parent->left = new;
+	else
+		parent->right = new;
+	if (new)
+		new->parent = parent;
+}
+
+static void rotate_left(struct rb_root *root, struct rb_node *x)
+{
+	struct rb_node *y = x->right;
+
+	x->right = y->left;
+	if (y->left)
+		y->left->parent = x;
+	replace_child(root, x, y);
+	y->left = x;
+	x->parent = y;
+}
+
+static void rotate_right(struct rb_root *root, struct rb_node *x)
+{
+	struct rb_node *y = x->left;
+
+	x->left = y->right;
+	if (y->right)
+		y->right->parent = x;
+	replace_child(root, x, y);
+	y->right = x;
+	x->parent = y;
+}
+
+/* Attach node as a red leaf at *link, below parent (NULL for an empty tree). */
+void rb_link(struct rb_node *node, struct rb_node *parent, struct rb_node **link)
+{
+	node->parent = parent;
+	node->left = node->right = NULL;
+	node->red = 1;
+	*link = node;
+}
+
+/* Restore the red-black properties after rb_link. */
+void rb_insert_fixup(struct rb_root *root, struct rb_node *node)
+{
+	struct rb_node *parent, *gparent, *uncle;
+
+	while ((parent = node->parent) && parent->red)
+	{
+		gparent = parent->parent;
+		if (parent == gparent->left)
+		{
+			uncle = gparent->right;
+			if (uncle && uncle->red)
+			{
+				parent->red = uncle->red = 0;
+				gparent->red = 1;
+				node = gparent;
+				continue;
+			}
+			if (node == parent->right)
+			{
+				rotate_left(root, parent);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->red = 0;
+			gparent->red = 1;
+			rotate_right(root, gparent);
+		}
+		else
+		{
+			uncle = gparent->left;
+			if (uncle && uncle->red)
+			{
+				parent->red = uncle->red = 0;
+				gparent->red = 1;
+				node = gparent;
+				continue;
+			}
+			if (node == parent->left)
+			{
+				rotate_right(root, parent);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->red = 0;
+			gparent->red = 1;
+			rotate_left(root, gparent);
+		}
+	}
+	root->node->red = 0;
+}
+
+/* Rebalance after removing a black node; x (maybe NULL) took its place below parent. */
+static void erase_fixup(struct rb_root *root, struct rb_node *x, struct rb_node *parent)
+{
+	struct rb_node *w;
+
+	while (x != root->node && (!x || !x->red))
+	{
+		if (x == parent->left)
+		{
+			w = parent->right;
+			if (w->red)
+			{
+				w->red = 0;
+				parent->red = 1;
+				rotate_left(root, parent);
+				w = parent->right;
+			}
+			if ((!w->left || !w->left->red) && (!w->right || !w->right->red))
+			{
+				w->red = 1;
+				x = parent;
+				parent = x->parent;
+			}
+			else
+			{
+				if (!w->right || !w->right->red)
+				{
+					w->left->red = 0;
+					w->red = 1;
+					rotate_right(root, w);
+					w = parent->right;
+				}
+				w->red = parent->red;
+				parent->red = 0;
+				w->right->red = 0;
+				rotate_left(root, parent);
+				x = root->node;
+			}
+		}
+		else
+		{
+			w = parent->left;
+			if (w->red)
+			{
+				w->red = 0;
+				parent->red = 1;
+				rotate_right(root, parent);
+				w = parent->left;
+			}
+			if ((!w->right || !w->right->red) && (!w->left || !w->left->red))
+			{
+				w->red = 1;
+				x = parent;
+				parent = x->parent;
+			}
+			else
+			{
+				if (!w->left || !w->left->red)
+				{
+					w->right->red = 0;
+					w->red = 1;
+					rotate_left(root, w);
+					w = parent->left;
+				}
+				w->red = parent->red;
+				parent->red = 0;
+				w->left->red = 0;
+				rotate_right(root, parent);
+				x = root->node;
+			}
+		}
+	}
+	if (x)
+		x->red = 0;
+}
+
+void rb_erase(struct rb_root *root, struct rb_node *node)
+{
+	struct rb_node *x, *parent;
+	int removed_red = node->red;
+
+	if (!node->left)
+	{
+		x = node->right;
+		parent = node->parent;
+		replace_child(root, node, x);
+	}
+	else if (!node->right)
+	{
+		x = node->left;
+		parent = node->parent;
+		replace_child(root, node, x);
+	}
+	else
+	{
+		/* splice out the successor and move it into node's place */
+		struct rb_node *y = node->right;
+
+		while (y->left)
+			y = y->left;
+		removed_red = y->red;
+		x = y->right;
+		if (y->parent == node)
+		{
+			parent = y;
+		}
+		else
+		{
+			parent = y->parent;
+			replace_child(root, y, x);
+			y->right = node->right;
+			y->right->parent = y;
+		}
+		replace_child(root, node, y);
+		y->left = node->left;
+		y->left->parent = y;
+		y->red = node->red;
+	}
+
+	if (!removed_red)
+		erase_fixup(root, x, parent);
+}
+
+struct rb_node *rb_first(struct rb_root *root)
+{
+	struct rb_node *n = root->node;
+
+	if (!n)
+		return NULL;
+	while (n->left)
+		n = n->left;
+	return n;
+}
+
+struct rb_node *rb_last(struct rb_root *root)
+{
+	struct rb_node *n = root->node;
+
+	if (!n)
+		return NULL;
+	while (n->right)
+		n = n->right;
+	return n;
+}
+
+struct rb_node *rb_next(struct rb_node *node)
+{
+	struct rb_node *parent;
+
+	if (node->right)
+	{
+		node = node->right;
+		while (node->left)
+			node = node->left;
+		return node;
+	}
+	while ((parent = node->parent) && node == parent->right)
+		node = parent;
+	return parent;
+}
+
+struct rb_node *rb_prev(struct rb_node *node)
+{
+	struct rb_node *parent;
+
+	if (node->left)
+	{
+		node = node->left;
+		while (node->right)
+			node = node->right;
+		return node;
+	}
+	while ((parent = node->parent) && node == parent->left)
+		node = parent;
+	return parent;
+}
@@ -0,0 +1,36 @@
+/*
+An intrusive red-black tree.
+Nodes are embedded in the caller's own structures, so the tree never
+allocates; the caller descends to the insertion point itself (it owns the
+ordering), links the node there with rb_link and then rebalances with
+rb_insert_fixup.
+*/
+#ifndef RBTREE_H
+#define RBTREE_H
+
+struct rb_node
+{
+	struct rb_node *parent;
+	struct rb_node *left;
+	struct rb_node *right;
+	int red;
+};
+
+struct rb_root
+{
+	struct rb_node *node;
+};
+
+/* Recover the structure containing an embedded rb_node. */
+#define rb_entry(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+void rb_link(struct rb_node *node, struct rb_node *parent, struct rb_node **link);
+void rb_insert_fixup(struct rb_root *root, struct rb_node *node);
+void rb_erase(struct rb_root *root, struct rb_node *node);
+
+struct rb_node *rb_first(struct rb_root *root);
+struct rb_node *rb_last(struct rb_root *root);
+struct rb_node *rb_next(struct rb_node *node);
+struct rb_node *rb_prev(struct rb_node *node);
+
+#endif
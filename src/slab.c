@@ -0,0 +1,377 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "slab.h"
+
+/* Slab layer, see slab.h.
+ *
+ * Every slab has a descriptor outside the pool, so a slab is exactly its
+ * objects and nothing else. Slabs with free objects are linked into their
+ * class's partial list.
+ *
+ * To find the slab of a pointer in constant time, the address range slabs
+ * come from is cut into chunks no larger than the smallest slab there can
+ * be. Then at most one slab starts inside a chunk after its first byte, and
+ * at most one covers that first byte, and the chunk map keeps both. A slab
+ * that cannot be had at its full size is made smaller, but never below the
+ * chunk size.
+ *
+ * Objects are handed out from the slab's free list first, then bumped off
+ * its untouched end. Objects need not be aligned for a pointer, so the free
+ * list links are copied in and out bytewise.
+ */
+
+// smallest object that can hold the free list link
+#define SLAB_MIN_OBJECT sizeof(void *)
+// bytes a slab is sized for by default, within the object count limits below
+#define SLAB_BYTES 4096
+#define SLAB_MIN_OBJECTS 4
+#define SLAB_MAX_OBJECTS 64
+
+static const size_t defaultSizes[] = {16, 32, 64, 128, 256, 512, 0};
+
+struct slab
+{
+    struct slab *allPrev, *allNext; // every slab of the cache
+    struct slab *prev, *next; // partial list of the class
+    char *base;
+    int cls;
+    int capacity; // objects in the slab
+    int used;     // objects handed out
+    int bumped;   // objects ever handed out from the untouched end
+    void *free;   // objects given back, linked through their first bytes
+};
+
+void slab_init(struct slab_cache *c, const size_t *sizes, int objects, size_t align, void *base, size_t span,
+               void *(*grab)(void *ctx, size_t size), void (*release)(void *ctx, void *ptr), void *ctx)
+{
+    size_t smallest = 0;
+    int i;
+
+    if (!sizes)
+    {
+        sizes = defaultSizes;
+    }
+
+    for (c->count = 0; c->count < SLAB_MAX_CLASSES && sizes[c->count]; c->count++)
+    {
+        struct slab_class *cls = &c->classes[c->count];
+
+        cls->size = sizes[c->count] < SLAB_MIN_OBJECT ? SLAB_MIN_OBJECT : sizes[c->count];
+        // slabs start aligned, so objects a multiple of align apart are all aligned
+        cls->size = (cls->size + align - 1) / align * align;
+        cls->perSlab = objects;
+        if (cls->perSlab <= 0)
+        {
+            cls->perSlab = SLAB_BYTES / cls->size;
+            cls->perSlab = cls->perSlab < SLAB_MIN_OBJECTS ? SLAB_MIN_OBJECTS
+                         : cls->perSlab > SLAB_MAX_OBJECTS ? SLAB_MAX_OBJECTS
+                         : cls->perSlab;
+        }
+        cls->partial = NULL;
+        cls->slabs = cls->capacity = cls->inUse = 0;
+        if (!smallest || cls->size * cls->perSlab < smallest)
+        {
+            smallest = cls->size * cls->perSlab;
+        }
+    }
+    for (i = 1; i < c->count; i++)
+    {
+        // classes are searched in order, the first one big enough wins
+        if (c->classes[i].size < c->classes[i - 1].size)
+        {
+            fprintf(stderr, "slab_init: size classes must be ascending\n");
+            abort();
+        }
+    }
+
+    c->all = NULL;
+    c->base = base;
+    for (c->chunk = 1; c->chunk * 2 <= smallest; c->chunk *= 2)
+        ;
+    c->chunks = span / c->chunk + 1;
+    c->map = calloc(2 * c->chunks, sizeof(struct slab *));
+    if (!c->map)
+    {
+        // no slabs then, every request goes to the pool
+        c->count = 0;
+    }
+    c->grab = grab;
+    c->release = release;
+    c->ctx = ctx;
+}
+
+/* Drop all slab descriptors. The slabs themselves are not given back, this
+ * is for when the underlying pool is thrown away as a whole.
+ */
+void slab_destroy(struct slab_cache *c)
+{
+    struct slab *s, *next;
+
+    for (s = c->all; s; s = next)
+    {
+        next = s->allNext;
+        free(s);
+    }
+    c->all = NULL;
+    free(c->map);
+    c->map = NULL;
+    c->count = 0;
+}
+
+int slab_class_of(struct slab_cache *c, size_t size)
+{
+    int i;
+
+    for (i = 0; i < c->count; i++)
+    {
+        if (size <= c->classes[i].size)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void unlinkPartial(struct slab_class *cls, struct slab *s)
+{
+    if (s->prev)
+    {
+        s->prev->next = s->next;
+    }
+    else
+    {
+        cls->partial = s->next;
+    }
+    if (s->next)
+    {
+        s->next->prev = s->prev;
+    }
+}
+
+static void linkPartial(struct slab_class *cls, struct slab *s)
+{
+    s->prev = NULL;
+    s->next = cls->partial;
+    if (s->next)
+    {
+        s->next->prev = s;
+    }
+    cls->partial = s;
+}
+
+/* Enter s into the chunk map, or with s NULL take the slab at base of bytes out of it. */
+static void mapSlab(struct slab_cache *c, struct slab *s, char *base, size_t bytes)
+{
+    size_t first = (base - c->base) / c->chunk, last = (base + bytes - 1 - c->base) / c->chunk, i;
+
+    // a slab starting on a chunk boundary covers its first byte
+    c->map[2 * first + ((base - c->base) % c->chunk != 0)] = s;
+    for (i = first + 1; i <= last; i++)
+    {
+        c->map[2 * i] = s;
+    }
+}
+
+/* Carve a new slab for a class, with fewer objects if the full size does not fit. */
+static struct slab *newSlab(struct slab_cache *c, int cls)
+{
+    struct slab_class *class = &c->classes[cls];
+    int objects = class->perSlab;
+    // at most one slab may start inside a chunk
+    int fewest = (c->chunk + class->size - 1) / class->size;
+    char *base;
+    struct slab *s;
+
+    while (!(base = c->grab(c->ctx, objects * class->size)))
+    {
+        if ((objects /= 2) < fewest)
+        {
+            return NULL;
+        }
+    }
+
+    s = malloc(sizeof(struct slab));
+    s->base = base;
+    s->cls = cls;
+    s->capacity = objects;
+    s->used = s->bumped = 0;
+    s->free = NULL;
+
+    s->allPrev = NULL;
+    s->allNext = c->all;
+    if (c->all)
+    {
+        c->all->allPrev = s;
+    }
+    c->all = s;
+    mapSlab(c, s, base, objects * class->size);
+
+    class->slabs++;
+    class->capacity += s->capacity;
+    linkPartial(class, s);
+    return s;
+}
+
+/* Give an empty slab back to the underlying allocator. */
+static void dropSlab(struct slab_cache *c, struct slab *s)
+{
+    struct slab_class *class = &c->classes[s->cls];
+
+    unlinkPartial(class, s);
+    if (s->allPrev)
+    {
+        s->allPrev->allNext = s->allNext;
+    }
+    else
+    {
+        c->all = s->allNext;
+    }
+    if (s->allNext)
+    {
+        s->allNext->allPrev = s->allPrev;
+    }
+    mapSlab(c, NULL, s->base, s->capacity * class->size);
+    class->slabs--;
+    class->capacity -= s->capacity;
+    c->release(c->ctx, s->base);
+    free(s);
+}
+
+/* Take an object of class cls, NULL if no slab could be carved for it. */
+void *slab_alloc(struct slab_cache *c, int cls)
+{
+    struct slab_class *class = &c->classes[cls];
+    struct slab *s = class->partial;
+    void *obj;
+
+    if (!s && !(s = newSlab(c, cls)))
+    {
+        return NULL;
+    }
+
+    if (s->free)
+    {
+        obj = s->free;
+        memcpy(&s->free, obj, sizeof(s->free));
+    }
+    else
+    {
+        obj = s->base + s->bumped++ * class->size;
+    }
+
+    s->used++;
+    class->inUse++;
+    if (s->used == s->capacity)
+    {
+        unlinkPartial(class, s);
+    }
+    return obj;
+}
+
+/* The slab whose objects cover ptr, NULL if there is none. */
+static struct slab *findSlab(struct slab_cache *c, void *ptr)
+{
+    size_t i;
+    struct slab *s;
+
+    if (!c->map || (char *)ptr < c->base || (i = ((char *)ptr - c->base) / c->chunk) >= c->chunks)
+    {
+        return NULL;
+    }
+
+    // the slab starting inside the chunk, unless ptr comes before it
+    s = c->map[2 * i + 1];
+    if (!s || (char *)ptr < s->base)
+    {
+        s = c->map[2 * i];
+    }
+
+    if (!s || (char *)ptr < s->base || (char *)ptr >= s->base + s->capacity * c->classes[s->cls].size)
+    {
+        return NULL;
+    }
+    return s;
+}
+
+/* Bytes per object of the slab holding ptr, 0 if ptr is not in any slab. */
+size_t slab_object_size(struct slab_cache *c, void *ptr)
+{
+    struct slab *s = findSlab(c, ptr);
+
+    return s ? c->classes[s->cls].size : 0;
+}
+
+/* Give an object back to its slab. Returns 0 if ptr is not in any slab. */
+int slab_free(struct slab_cache *c, void *ptr)
+{
+    struct slab *s = findSlab(c, ptr);
+    struct slab_class *class;
+
+    if (!s)
+    {
+        return 0;
+    }
+    class = &c->classes[s->cls];
+    if (((char *)ptr - s->base) % class->size)
+    {
+        // not an object start, nothing to free
+        return 1;
+    }
+
+    if (s->used == s->capacity)
+    {
+        linkPartial(class, s);
+    }
+    memcpy(ptr, &s->free, sizeof(s->free));
+    s->free = ptr;
+    s->used--;
+    class->inUse--;
+
+    // an empty slab goes back to the pool, unless it is all the class has left to give
+    if (s->used == 0 && (s->prev || s->next))
+    {
+        dropSlab(c, s);
+    }
+    return 1;
+}
+
+/* Give every empty slab back to the underlying allocator. Returns 1 if there was any. */
+int slab_trim(struct slab_cache *c)
+{
+    int i, trimmed = 0;
+
+    for (i = 0; i < c->count; i++)
+    {
+        struct slab_class *class = &c->classes[i];
+        struct slab *s = class->partial, *next;
+
+        // empty slabs always have free objects, so they are all on the partial list
+        for (; s; s = next)
+        {
+            next = s->next;
+            if (s->used == 0)
+            {
+                dropSlab(c, s);
+                trimmed = 1;
+            }
+        }
+    }
+    return trimmed;
+}
+
+void slab_print(struct slab_cache *c)
+{
+    int i;
+
+    for (i = 0; i < c->count; i++)
+    {
+        struct slab_class *class = &c->classes[i];
+
+        if (class->slabs)
+        {
+            printf("Slab class %zu bytes: %d of %d objects in use in %d slabs.\n",
+                   class->size, class->inUse, class->capacity, class->slabs);
+        }
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+/* A slab layer for fixed-size objects. Requests that fit one of a few size
+ * classes are served from slabs: blocks of several objects taken from the
+ * underlying allocator through the grab callback, whose free objects are
+ * chained through their own first bytes.
+ */
+
+#define SLAB_MAX_CLASSES 16
+
+struct slab;
+
+struct slab_class
+{
+    size_t size;          // bytes per object
+    int perSlab;          // objects a new slab is sized for
+    struct slab *partial; // slabs with at least one free object
+    int slabs;            // slabs of this class
+    int capacity;         // objects in those slabs
+    int inUse;            // objects handed out
+};
+
+struct slab_cache
+{
+    struct slab_class classes[SLAB_MAX_CLASSES];
+    int count;
+    struct slab *all; // every slab
+
+    // which slabs cover which chunks of the address range the slabs are grabbed from
+    char *base;
+    size_t chunk;       // bytes per chunk, a power of two no slab is smaller than
+    size_t chunks;
+    struct slab **map;  // per chunk, the slab covering its first byte and the one starting after it
+
+    void *(*grab)(void *ctx, size_t size); // take a block from the underlying allocator
+    void (*release)(void *ctx, void *ptr); // give it back
+    void *ctx;
+};
+
+void slab_init(struct slab_cache *c, const size_t *sizes, int objects, size_t align, void *base, size_t span,
+               void *(*grab)(void *ctx, size_t size), void (*release)(void *ctx, void *ptr), void *ctx);
+void slab_destroy(struct slab_cache *c);
+int slab_class_of(struct slab_cache *c, size_t size);
+void *slab_alloc(struct slab_cache *c, int cls);
+int slab_free(struct slab_cache *c, void *ptr);
+size_t slab_object_size(struct slab_cache *c, void *ptr);
+int slab_trim(struct slab_cache *c);
+void slab_print(struct slab_cache *c);
+
+#endif
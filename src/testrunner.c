@@ -4,7 +4,10 @@ Original Author: L. Angrave
 */
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
 #include <errno.h>
+#include <dirent.h>
+#include <time.h>
 
 #include <stdio.h>
 #include <signal.h>
@@ -23,6 +26,12 @@ Original Author: L. Angrave
 /* defaults */
 static int default_timeout_seconds=5;
 static int timeout_seconds;
+static unsigned run_seed;
+
+/* A seed for random tests, the same for every test and child of a run, so a run can be repeated with -s */
+unsigned testrunner_seed(void) {
+	return run_seed;
+}
 
 void set_testrunner_default_timeout(int s) {
 	assert(s>0);
@@ -38,6 +47,11 @@ void set_testrunner_timeout(int s) {
 #define DIE(mesg) {fprintf(stderr,"\n%s(%d):%s\n",__fname__,__LINE__,mesg); exit(1);}
 static int eql( char*s1, char*s2) {return s1&&s2&&!strcmp(s1,s2);}
 
+/* A test is run if its name, its suite or 'all' is given */
+static int selected(char *target, testentry_t *test) {
+	return eql(target,test->name) || eql(target,"all") || eql(target,test->suite);
+}
+
 /* Callback function for qsort on strings */
 static int mystrcmp( const void *p1, const void *p2) {
 	return eql( ( char*)p1, ( char*)p2);
@@ -160,6 +174,357 @@ if (test_result == 0)
 	return test_result!=0;
 }
 
+/* -- Parallel runs (-jN) -- */
+
+/* One child of a parallel run: a whole test, or one strategy of a test that sweeps them */
+typedef struct
+{
+	testentry_t *test;
+	int slot;            /* position of the test among those run, results are reported in this order */
+	strategies strategy; /* the one strategy of a sweep child, NotSet to pass the command line on unchanged */
+	char dir[64];        /* working directory of the child, with its output and tests.log fragment */
+	pid_t pid;
+	time_t deadline;
+	int killed;
+	int term_signal;
+	int result;          /* as invoke_test_with_timelimit returns, -1 while the child runs */
+} job_t;
+
+/* Fork a child running the test in a directory of its own, so nothing it writes mixes with the others.
+ * Its tests.log is there from the start with a second link to it, so a test that starts a new log
+ * leaves a file with a single link behind. */
+static int launch_job(job_t *job, int argc, char **argv)
+{
+	char path[320], keep[330];
+	FILE *log;
+
+	snprintf(path,sizeof(path),"%s/tests.log",job->dir);
+	snprintf(keep,sizeof(keep),"%s.keep",path);
+	if (mkdir(job->dir,0700) || !(log = fopen(path,"w")))
+		return -1;
+	fclose(log);
+	if (link(path,keep))
+		return -1;
+
+	job->pid = fork();
+	if (job->pid == -1)
+		return -1;
+
+	if (job->pid == 0) {
+		if (chdir(job->dir) || !freopen("stdout.txt","w",stdout) || !freopen("stderr.txt","w",stderr))
+			_exit(1);
+		if (job->strategy != NotSet)
+			argv[1] = strategy_name(job->strategy);
+		exit(job->test->test_function(argc,argv));
+	}
+	job->deadline = time(NULL) + default_timeout_seconds;
+	return 0;
+}
+
+static void reap_job(job_t *job, int wait_status)
+{
+	if (WIFSIGNALED(wait_status))
+		job->term_signal = WTERMSIG(wait_status);
+	job->result = job->killed ? test_killed :
+		WIFEXITED(wait_status) && WEXITSTATUS(wait_status) == 0 ? 0 : 1;
+}
+
+/* Append the file at path to out. Nothing happens if there is no such file. */
+static void append_file(char *path, FILE *out)
+{
+	char buf[4096];
+	size_t n;
+	FILE *in = fopen(path,"r");
+
+	if (!in)
+		return;
+	while ((n = fread(buf,1,sizeof(buf),in)) > 0)
+		fwrite(buf,1,n,out);
+	fclose(in);
+}
+
+static void remove_dir(char *dir)
+{
+	char path[320];
+	struct dirent *entry;
+	DIR *d = opendir(dir);
+
+	if (d) {
+		while ((entry = readdir(d)))
+			if (!eql(entry->d_name,".") && !eql(entry->d_name,"..")) {
+				snprintf(path,sizeof(path),"%s/%s",dir,entry->d_name);
+				unlink(path);
+			}
+		closedir(d);
+	}
+	rmdir(dir);
+}
+
+/* Read a whole file into memory, NULL if there is none */
+static char *read_file(char *path, size_t *length)
+{
+	char buf[4096], *text = NULL, *grown;
+	size_t n;
+	FILE *in = fopen(path,"r");
+
+	*length = 0;
+	if (!in)
+		return NULL;
+	while ((n = fread(buf,1,sizeof(buf),in)) > 0) {
+		if (!(grown = realloc(text,*length + n))) {
+			free(text);
+			fclose(in);
+			*length = 0;
+			return NULL;
+		}
+		text = grown;
+		memcpy(text + *length,buf,n);
+		*length += n;
+	}
+	fclose(in);
+	return text;
+}
+
+/* A section of a log: a header line and the tab indented lines after it */
+typedef struct
+{
+	char *header, *body;
+	size_t header_length, body_length;
+} section_t;
+
+static size_t line_end(char *text, size_t length, size_t pos)
+{
+	char *nl = memchr(text + pos,'\n',length - pos);
+
+	return nl ? nl - text + 1 : length;
+}
+
+/* The section starting at *pos, moving *pos past it. Returns 0 at the end of the text. */
+static int next_section(char *text, size_t length, size_t *pos, section_t *section)
+{
+	size_t end = *pos;
+
+	if (*pos >= length)
+		return 0;
+	section->header = text + *pos;
+	if (text[*pos] != '\t')
+		end = line_end(text,length,*pos);
+	section->header_length = end - *pos;
+	section->body = text + end;
+	while (end < length && text[end] == '\t')
+		end = line_end(text,length,end);
+	section->body_length = text + end - section->body;
+	*pos = end;
+	return 1;
+}
+
+/* Add the tests.log fragments of a test's children to tests.log the way a serial run writes
+ * them. The children of a sweep each log every section of the test for their one strategy, so
+ * their logs are merged section by section; logs that do not line up are added one by one. */
+static void merge_logs(job_t *first, int count)
+{
+	char path[320];
+	char **text = calloc(count,sizeof(char*));
+	size_t *length = calloc(count,sizeof(size_t)), *pos = calloc(count,sizeof(size_t));
+	int i, restarted = 0, aligned = 1, more;
+	size_t total = 0;
+	struct stat st;
+	section_t section, other;
+	FILE *log;
+
+	if (!text || !length || !pos)
+		goto out;
+	for (i = 0; i < count; i++) {
+		snprintf(path,sizeof(path),"%s/tests.log",first[i].dir);
+		if (stat(path,&st) || st.st_nlink == 1)
+			restarted = 1;
+		text[i] = read_file(path,&length[i]);
+		total += length[i];
+	}
+
+	/* like the test, start a new log once for all its children */
+	if (restarted)
+		unlink("tests.log");
+	if (total == 0 || !(log = fopen("tests.log","a")))
+		goto out;
+
+	/* sections line up if every log has the same headers in the same order */
+	do {
+		more = next_section(text[0],length[0],&pos[0],&section);
+		for (i = 1; i < count; i++)
+			if (next_section(text[i],length[i],&pos[i],&other) != more || (more &&
+			    (other.header_length != section.header_length || memcmp(other.header,section.header,section.header_length))))
+				aligned = 0;
+	} while (more && aligned);
+
+	memset(pos,0,count * sizeof(size_t));
+	if (aligned)
+		while (next_section(text[0],length[0],&pos[0],&section)) {
+			fwrite(section.header,1,section.header_length,log);
+			fwrite(section.body,1,section.body_length,log);
+			for (i = 1; i < count; i++) {
+				next_section(text[i],length[i],&pos[i],&other);
+				fwrite(other.body,1,other.body_length,log);
+			}
+		}
+	else
+		for (i = 0; i < count; i++)
+			if (text[i])
+				fwrite(text[i],1,length[i],log);
+	fclose(log);
+
+out:
+	for (i = 0; text && i < count; i++)
+		free(text[i]);
+	free(text);
+	free(length);
+	free(pos);
+}
+
+/* Report a test once all its children are done, the way run_one_test does, and
+ * merge their output and tests.log fragments in strategy order */
+static int report_test(stats_t *stats, job_t *first, int count, int redirect_stdouterr)
+{
+	char path[320], fname[255];
+	FILE *out = stdout, *err = stderr;
+	int i, test_result = 0;
+
+	stats->ran++;
+	printf ("%2d.%-20s:", stats->ran, first->test->name);
+	fflush(stdout);
+
+	if (redirect_stdouterr) {
+		snprintf(fname,sizeof(fname),"stdout-%s.txt",first->test->name);
+		out = fopen(fname,"w");
+		memcpy(fname+3,"err",3);
+		err = fopen(fname,"w");
+	}
+
+	for (i = 0; i < count; i++) {
+		snprintf(path,sizeof(path),"%s/stdout.txt",first[i].dir);
+		append_file(path,out ? out : stdout);
+		snprintf(path,sizeof(path),"%s/stderr.txt",first[i].dir);
+		append_file(path,err ? err : stderr);
+
+		if (first[i].killed)
+			printf("-Timeout(Killing test process)-");
+		if (first[i].term_signal)
+			fprintf(stderr,"testrunner:Test terminated by signal %d\n",first[i].term_signal);
+		if (first[i].result > test_result)
+			test_result = first[i].result;
+	}
+	merge_logs(first,count);
+
+	if (redirect_stdouterr) {
+		if (out) fclose(out);
+		if (err) fclose(err);
+	}
+
+	if (test_result == 0)
+		stats->passed++;
+	else
+		stats->failed++;
+	printf(":%s\n", (test_result == 0 ? "pass" : test_result ==
+		2 ? "TIMEOUT * " : "FAIL *"));
+	fflush(stdout);
+	return test_result!=0;
+}
+
+/*
+ * Run the tests in up to jobs children at once, each with its own time limit.
+ * With 'all' for the strategy, a test that sweeps the strategies is split into
+ * one child per strategy. Results are reported in the order of a serial run.
+ */
+static void run_parallel(stats_t *stats, testentry_t **tests, int count, int jobs,
+	int max_errors_before_quit, int redirect_stdouterr, int argc, char **argv)
+{
+	char run_dir[] = "testrunner.XXXXXX";
+	int sweep = argc > 1 && strategyFromString(argv[1]) == NotSet;
+	int njobs = 0, next = 0, running = 0, reported = 0, first = 0;
+	int i, n, s, wait_status;
+	job_t *job;
+	pid_t pid;
+
+	for (i = 0; i < count; i++)
+		njobs += sweep && tests[i]->sweep ? LastStrategy : 1;
+	job = calloc(njobs,sizeof(job_t));
+	if (!job || !mkdtemp(run_dir)) {
+		fprintf(stderr,"testrunner: no room for a parallel run\n");
+		free(job);
+		return;
+	}
+
+	for (i = 0, n = 0; i < count; i++) {
+		int lbound = NotSet, ubound = NotSet;
+
+		if (sweep && tests[i]->sweep) {
+			lbound = 1;
+			ubound = LastStrategy;
+		}
+		for (s = lbound; s <= ubound; s++, n++) {
+			job[n].test = tests[i];
+			job[n].slot = i;
+			job[n].strategy = s;
+			job[n].result = -1;
+			snprintf(job[n].dir,sizeof(job[n].dir),"%s/%d",run_dir,n);
+		}
+	}
+
+	while (reported < count) {
+		int last;
+
+		for (; running < jobs && next < njobs; next++) {
+			if (launch_job(&job[next],argc,argv)) {
+				fprintf(stderr,"-fork failed-");
+				job[next].result = 1;
+			}
+			else
+				running++;
+		}
+
+		/* the next test to report, if all its children are done */
+		for (last = first; last < njobs && job[last].slot == reported && job[last].result >= 0; last++)
+			;
+		if (last == njobs || job[last].slot != reported) {
+			int failed = report_test(stats,&job[first],last-first,redirect_stdouterr);
+
+			first = last;
+			reported++;
+			if (failed && max_errors_before_quit >= 1 && stats->failed == max_errors_before_quit)
+				break;
+			continue;
+		}
+
+		pid = waitpid(-1,&wait_status,WNOHANG);
+		if (pid > 0) {
+			for (i = 0; i < next; i++)
+				if (job[i].pid == pid && job[i].result < 0) {
+					reap_job(&job[i],wait_status);
+					running--;
+				}
+			continue;
+		}
+
+		for (i = 0; i < next; i++)
+			if (job[i].result < 0 && !job[i].killed && time(NULL) >= job[i].deadline) {
+				kill(job[i].pid,SIGKILL);
+				job[i].killed = 1;
+			}
+		usleep(10000);
+	}
+
+	/* after too many failures, the children still running are of no interest */
+	for (i = 0; i < next; i++) {
+		if (job[i].result < 0 && job[i].pid > 0) {
+			kill(job[i].pid,SIGKILL);
+			waitpid(job[i].pid,&wait_status,0);
+		}
+		remove_dir(job[i].dir);
+	}
+	rmdir(run_dir);
+	free(job);
+}
+
 /* Help functionality to print out sorted list of test names and suite names */
 static void print_targets(testentry_t tests[], int count) {
 	 char**array;
@@ -185,7 +550,7 @@ static void print_targets(testentry_t tests[], int count) {
 	for(i=0,previous="";i<count; i++) if(!eql(previous,array[i])) printf(" %s",(previous=array[i]));
 	printf("\nValid strategies: all ");
 
-	for(i=1;i<5;i++)
+	for(i=1;i<=LastStrategy;i++)
 	  printf("%s ",strategy_name(i));
 	printf("\n");
 
@@ -202,11 +567,13 @@ run_testrunner(int argc, char **argv,testentry_t tests[],int test_count)
 	char *test_name, *target;
 	int i;
 	stats_t stats;
-	int target_matched,max_errors_before_quit,redirect_stdouterr;
+	int target_matched,max_errors_before_quit,redirect_stdouterr,jobs;
 	memset (&stats, 0, sizeof (stats));
 
 	max_errors_before_quit=1;
 	redirect_stdouterr=0;
+	jobs=1;
+	run_seed=time(NULL);
 
 	assert (tests != NULL);
 	assert(test_count>0);
@@ -220,17 +587,37 @@ run_testrunner(int argc, char **argv,testentry_t tests[],int test_count)
 		max_errors_before_quit=atoi(target+1);
 	else if(target[1]=='r')
 		redirect_stdouterr=1;
+	else if(target[1]=='j')
+		jobs=atoi(target+2);
+	else if(target[1]=='s')
+		run_seed=strtoul(target+2,NULL,0);
 	}
 
 	target_matched = false;
 
+	if (jobs > 1) {
+	  testentry_t **matched = calloc(test_count,sizeof(testentry_t*));
+	  int count = 0;
+
+	  for (i=0;i<test_count;i++)
+	    if (selected(target,&tests[i]))
+	      matched[count++] = &tests[i];
+	  if (count) {
+	    printf("Running tests...\n");
+	    fflush(stdout);
+	    target_matched = true;
+	    run_parallel(&stats,matched,count,jobs,max_errors_before_quit,redirect_stdouterr,argc - 1,argv + 1);
+	  }
+	  free(matched);
+	}
+	else
 	for (i=0;i<test_count && (max_errors_before_quit<1 || stats.failed != max_errors_before_quit);i++) {
 	  test_name = tests[i].name;
 
 	  assert(test_name);
 	  assert(tests[i].suite);
 	  assert(tests[i].test_function);
-	  if (eql(target,test_name)||eql(target,"all") || eql (target,tests[i].suite) ) {
+	  if (selected(target,&tests[i])) {
 		if(!target_matched) printf("Running tests...\n");
 	  target_matched = true;
 	  run_one_test (&stats, &tests[i],redirect_stdouterr, argc - 1,argv + 1);
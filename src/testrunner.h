@@ -5,10 +5,12 @@ typedef struct
   char *name;
   char *suite;
   test_fp test_function;
+  int sweep; /* 1 if the test loops over every strategy for 'all', -jN then runs each strategy in a child of its own */
 
 } testentry_t;
 
 int run_testrunner(int argc, char **argv, testentry_t *entries,int entry_count);
 void set_testrunner_default_timeout(int s);
 void set_testrunner_timeout(int s);
+unsigned testrunner_seed(void);
 
@@ -0,0 +1,329 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include "trace.h"
+
+/* Trace recorder and reader, see trace.h.
+ *
+ * The recorder is one per process. It gives every block it sees allocated
+ * an id and keeps them in a hash table by address, open addressing with
+ * linear probing, for the free and realloc events to find. Blocks that were
+ * allocated before recording started are not in there, and their frees are
+ * left out of the trace.
+ */
+
+#define TRACE_MAGIC "MTRC"
+#define TRACE_VERSION 1
+
+struct slot
+{
+    void *ptr; // NULL for an empty slot
+    uint64_t id;
+};
+
+static pthread_mutex_t recorderLock = PTHREAD_MUTEX_INITIALIZER;
+static int recording;
+static FILE *out;
+static struct timespec last;
+static uint64_t nextId;
+static struct slot *table;
+static size_t tableSize, tableUsed; // tableSize is a power of two
+
+static size_t slotOf(void *ptr)
+{
+    uintptr_t h = (uintptr_t)ptr;
+
+    // blocks are aligned, the low bits say little
+    h ^= h >> 17;
+    h *= 0x9e3779b97f4a7c15ULL;
+    return (h >> 20) & (tableSize - 1);
+}
+
+static void tableInsert(void *ptr, uint64_t id);
+
+static void tableGrow(void)
+{
+    struct slot *old = table;
+    size_t oldSize = tableSize, i;
+
+    tableSize = tableSize ? tableSize * 2 : 1024;
+    table = calloc(tableSize, sizeof(struct slot));
+    tableUsed = 0;
+    for (i = 0; i < oldSize; i++)
+    {
+        if (old[i].ptr)
+        {
+            tableInsert(old[i].ptr, old[i].id);
+        }
+    }
+    free(old);
+}
+
+static void tableInsert(void *ptr, uint64_t id)
+{
+    size_t i;
+
+    // at most half full keeps the probes short
+    if (2 * (tableUsed + 1) > tableSize)
+    {
+        tableGrow();
+    }
+    for (i = slotOf(ptr); table[i].ptr && table[i].ptr != ptr; i = (i + 1) & (tableSize - 1))
+        ;
+    tableUsed += !table[i].ptr;
+    table[i].ptr = ptr;
+    table[i].id = id;
+}
+
+/* Take ptr out of the table, storing its id. Returns 0 if it is not there. */
+static int tableRemove(void *ptr, uint64_t *id)
+{
+    size_t i, j;
+
+    if (!tableSize)
+    {
+        return 0;
+    }
+    for (i = slotOf(ptr); table[i].ptr != ptr; i = (i + 1) & (tableSize - 1))
+    {
+        if (!table[i].ptr)
+        {
+            return 0;
+        }
+    }
+    *id = table[i].id;
+
+    // move later entries of the probe run back into the hole, so no run is cut short
+    for (j = (i + 1) & (tableSize - 1); table[j].ptr; j = (j + 1) & (tableSize - 1))
+    {
+        size_t home = slotOf(table[j].ptr);
+
+        if (((j - home) & (tableSize - 1)) >= ((j - i) & (tableSize - 1)))
+        {
+            table[i] = table[j];
+            i = j;
+        }
+    }
+    table[i].ptr = NULL;
+    tableUsed--;
+    return 1;
+}
+
+static void putVarint(uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        putc((int)(value & 0x7f) | 0x80, out);
+        value >>= 7;
+    }
+    putc((int)value, out);
+}
+
+static int getVarint(FILE *in, uint64_t *value)
+{
+    int c, shift = 0;
+
+    *value = 0;
+    do
+    {
+        if ((c = getc(in)) == EOF || shift > 63)
+        {
+            return 0;
+        }
+        *value |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 1;
+}
+
+/* Write an event, with the recorder lock held. */
+static void putEvent(int op, uint64_t id, uint64_t size)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    putc(op, out);
+    putVarint((now.tv_sec - last.tv_sec) * 1000000000ULL + now.tv_nsec - last.tv_nsec);
+    putVarint(id);
+    if (op != TRACE_FREE)
+    {
+        putVarint(size);
+    }
+    last = now;
+}
+
+/* Start recording the allocator calls to the file at path, overwriting it.
+ * Returns 0, or -1 if the file cannot be written or a recording is running.
+ */
+int trace_record_start(const char *path, size_t poolSize, int strategy)
+{
+    int failed = 0;
+
+    pthread_mutex_lock(&recorderLock);
+    if (recording || !(out = fopen(path, "wb")))
+    {
+        failed = -1;
+    }
+    else
+    {
+        fwrite(TRACE_MAGIC, 1, 4, out);
+        putc(TRACE_VERSION, out);
+        putVarint(poolSize);
+        putVarint(strategy);
+        nextId = 0;
+        clock_gettime(CLOCK_MONOTONIC, &last);
+        __atomic_store_n(&recording, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&recorderLock);
+    return failed;
+}
+
+void trace_record_stop(void)
+{
+    pthread_mutex_lock(&recorderLock);
+    if (recording)
+    {
+        __atomic_store_n(&recording, 0, __ATOMIC_RELEASE);
+        fclose(out);
+        out = NULL;
+        free(table);
+        table = NULL;
+        tableSize = tableUsed = 0;
+    }
+    pthread_mutex_unlock(&recorderLock);
+}
+
+/* 1 while a recording runs, cheap enough to ask on every call. */
+int trace_recording(void)
+{
+    return __atomic_load_n(&recording, __ATOMIC_ACQUIRE);
+}
+
+void trace_record_alloc(void *ptr, size_t size)
+{
+    pthread_mutex_lock(&recorderLock);
+    if (recording)
+    {
+        // failed allocations are recorded too, their ids are just never freed
+        if (ptr)
+        {
+            tableInsert(ptr, nextId);
+        }
+        putEvent(TRACE_ALLOC, nextId++, size);
+    }
+    pthread_mutex_unlock(&recorderLock);
+}
+
+void trace_record_free(void *ptr)
+{
+    uint64_t id;
+
+    pthread_mutex_lock(&recorderLock);
+    if (recording && ptr && tableRemove(ptr, &id))
+    {
+        putEvent(TRACE_FREE, id, 0);
+    }
+    pthread_mutex_unlock(&recorderLock);
+}
+
+/* Take old out of the recorder ahead of a realloc, the way a free is
+ * recorded before the block goes back. Returns 0 if old is not being traced,
+ * otherwise its id, to pass on to trace_record_realloc once the call is done.
+ */
+int trace_record_realloc_start(void *old, uint64_t *id)
+{
+    int found;
+
+    pthread_mutex_lock(&recorderLock);
+    found = recording && tableRemove(old, id);
+    pthread_mutex_unlock(&recorderLock);
+    return found;
+}
+
+/* A realloc of old to size bytes that returned ptr, NULL if it failed. */
+void trace_record_realloc(uint64_t id, void *old, void *ptr, size_t size)
+{
+    pthread_mutex_lock(&recorderLock);
+    if (recording)
+    {
+        tableInsert(ptr ? ptr : old, id);
+        putEvent(TRACE_REALLOC, id, size);
+    }
+    pthread_mutex_unlock(&recorderLock);
+}
+
+/* Read the whole trace at path into t. Returns 0, or -1 if it cannot be
+ * read or is no trace, ids out of order included; a trace cut short, or
+ * too long to fit in memory, keeps the events up to the cut.
+ */
+int trace_load(const char *path, struct trace *t)
+{
+    FILE *in = fopen(path, "rb");
+    char magic[4];
+    uint64_t poolSize, strategy;
+    size_t capacity = 1024;
+    int op;
+
+    memset(t, 0, sizeof(*t));
+    if (!in)
+    {
+        return -1;
+    }
+    if (fread(magic, 1, 4, in) != 4 || memcmp(magic, TRACE_MAGIC, 4) || getc(in) != TRACE_VERSION
+        || !getVarint(in, &poolSize) || !getVarint(in, &strategy))
+    {
+        fclose(in);
+        return -1;
+    }
+    t->poolSize = poolSize;
+    t->strategy = strategy;
+    if (!(t->events = malloc(capacity * sizeof(struct trace_event))))
+    {
+        fclose(in);
+        return -1;
+    }
+
+    while ((op = getc(in)) != EOF)
+    {
+        struct trace_event *e;
+
+        if (t->count == capacity)
+        {
+            struct trace_event *grown = realloc(t->events, 2 * capacity * sizeof(struct trace_event));
+
+            if (!grown)
+            {
+                break;
+            }
+            t->events = grown;
+            capacity *= 2;
+        }
+        e = &t->events[t->count];
+        e->op = op;
+        e->size = 0;
+        if (op < TRACE_ALLOC || op > TRACE_REALLOC || !getVarint(in, &e->delta) || !getVarint(in, &e->id)
+            || (op != TRACE_FREE && !getVarint(in, &e->size)))
+        {
+            break;
+        }
+        // ids are handed out one by one as blocks are allocated, any other is no trace of ours
+        if (op == TRACE_ALLOC ? e->id != t->ids : e->id >= t->ids)
+        {
+            fclose(in);
+            trace_unload(t);
+            return -1;
+        }
+        t->ids += op == TRACE_ALLOC;
+        t->count++;
+    }
+    fclose(in);
+    return 0;
+}
+
+void trace_unload(struct trace *t)
+{
+    free(t->events);
+    memset(t, 0, sizeof(*t));
+}
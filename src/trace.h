@@ -0,0 +1,53 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Allocation traces: a compact binary log of the calls made to the
+ * allocator, to be replayed against any strategy.
+ *
+ * A trace starts with the magic "MTRC", a version byte and the size and
+ * strategy of the pool it was recorded on. Every event after that is an op
+ * byte followed by LEB128 varints: the nanoseconds since the previous
+ * event, the block id and, for allocations and reallocations, the size.
+ * Ids are handed out in the order blocks are allocated, from 0, so a replay
+ * can keep its blocks in an array.
+ */
+
+enum trace_op
+{
+    TRACE_ALLOC = 1,
+    TRACE_FREE = 2,
+    TRACE_REALLOC = 3
+};
+
+struct trace_event
+{
+    int op;
+    uint64_t delta; // nanoseconds since the previous event
+    uint64_t id;
+    uint64_t size; // 0 for frees
+};
+
+struct trace
+{
+    size_t poolSize;
+    int strategy;
+    struct trace_event *events;
+    size_t count;
+    uint64_t ids; // one more than the highest id
+};
+
+int trace_record_start(const char *path, size_t poolSize, int strategy);
+void trace_record_stop(void);
+int trace_recording(void);
+void trace_record_alloc(void *ptr, size_t size);
+void trace_record_free(void *ptr);
+int trace_record_realloc_start(void *old, uint64_t *id);
+void trace_record_realloc(uint64_t id, void *old, void *ptr, size_t size);
+
+int trace_load(const char *path, struct trace *t);
+void trace_unload(struct trace *t);
+
+#endif